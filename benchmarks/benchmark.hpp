@@ -0,0 +1,106 @@
+// Copyright 2024 Can Joshua Lehmann
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef EGRAPHS_BENCHMARK_HPP
+#define EGRAPHS_BENCHMARK_HPP
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <string>
+#include <cstdlib>
+
+#include "../egraphs.hpp"
+
+namespace benchmark {
+  enum class NodeKind {
+    Value, Neg, Add, Mul
+  };
+  
+  // Node data with an integer payload, so that benchmarks can create
+  // arbitrarily many distinct leaf nodes.
+  class NodeData {
+  private:
+    NodeKind _kind;
+    uint64_t _value = 0;
+  public:
+    NodeData(const NodeKind& kind): _kind(kind) {}
+    NodeData(uint64_t value): _kind(NodeKind::Value), _value(value) {}
+    
+    NodeKind kind() const { return _kind; }
+    uint64_t value() const { return _value; }
+    
+    bool operator==(const NodeData& other) const {
+      return _kind == other._kind && _value == other._value;
+    }
+    
+    bool operator!=(const NodeData& other) const { return !(*this == other); }
+  };
+  
+  // Deterministic pseudo random numbers (xorshift64)
+  class Random {
+  private:
+    uint64_t _state = 0x9e3779b97f4a7c15;
+  public:
+    Random() {}
+    explicit Random(uint64_t seed): _state(seed | 1) {}
+    
+    uint64_t next() {
+      _state ^= _state << 13;
+      _state ^= _state >> 7;
+      _state ^= _state << 17;
+      return _state;
+    }
+    
+    uint64_t next(uint64_t max) {
+      return next() % max;
+    }
+  };
+  
+  class Timer {
+  private:
+    using Clock = std::chrono::steady_clock;
+    Clock::time_point _start;
+  public:
+    Timer(): _start(Clock::now()) {}
+    
+    double seconds() const {
+      return std::chrono::duration<double>(Clock::now() - _start).count();
+    }
+  };
+  
+  // Largest problem size of a benchmark.
+  // Can be overwritten by passing a number as the first argument.
+  inline size_t max_size(int argc, char** argv, size_t fallback) {
+    if (argc > 1) {
+      return std::strtoull(argv[1], nullptr, 10);
+    }
+    return fallback;
+  }
+}
+
+template <>
+struct std::hash<benchmark::NodeData> {
+  size_t operator()(const benchmark::NodeData& data) const {
+    return std::hash<uint64_t>()(data.value()) ^
+           (std::hash<benchmark::NodeKind>()(data.kind()) << 17);
+  }
+};
+
+inline std::ostream& operator<<(std::ostream& stream, const benchmark::NodeData& data) {
+  stream << data.value();
+  return stream;
+}
+
+#endif
@@ -0,0 +1,109 @@
+// Copyright 2024 Can Joshua Lehmann
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Measures how creating nodes with EGraph::concurrent_node scales with
+// the number of threads. Every thread count inserts the same set of
+// nodes, of which a quarter are duplicates.
+
+#include <vector>
+#include <thread>
+
+#include "benchmark.hpp"
+
+using namespace benchmark;
+
+using EGraph = egraphs::EGraph<NodeKind, NodeData>;
+using Node = EGraph::Node;
+
+const size_t LEAVES = 1000;
+
+// Children of the it-th inserted node.
+// Every fourth node duplicates a node of another chunk.
+std::vector<Node*> children(const std::vector<Node*>& leaves, size_t it) {
+  size_t index = it % 4 == 0 ? it / 4 : it;
+  return {leaves[index % LEAVES], leaves[(index / LEAVES) % LEAVES]};
+}
+
+std::vector<Node*> build_leaves(EGraph& e_graph) {
+  std::vector<Node*> leaves;
+  for (size_t it = 0; it < LEAVES; it++) {
+    leaves.push_back(e_graph.node(NodeData(it)));
+  }
+  return leaves;
+}
+
+// Time needed to insert size nodes using EGraph::node
+double run_sequential(size_t size) {
+  EGraph e_graph;
+  std::vector<Node*> leaves = build_leaves(e_graph);
+  
+  Timer timer;
+  for (size_t it = 0; it < size; it++) {
+    e_graph.node(NodeKind::Add, children(leaves, it));
+  }
+  return timer.seconds();
+}
+
+// Time needed to insert size nodes using EGraph::concurrent_node
+double run(size_t size, size_t thread_count) {
+  EGraph e_graph;
+  std::vector<Node*> leaves = build_leaves(e_graph);
+  
+  egraphs::ThreadPool pool(thread_count);
+  const size_t CHUNK_SIZE = 1024;
+  size_t chunk_count = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+  
+  Timer timer;
+  e_graph.begin_concurrent(pool.size(), size);
+  pool.parallel_for(chunk_count, [&](size_t chunk, size_t thread){
+    size_t end = std::min(size, (chunk + 1) * CHUNK_SIZE);
+    for (size_t it = chunk * CHUNK_SIZE; it < end; it++) {
+      e_graph.concurrent_node(thread, NodeKind::Add, children(leaves, it));
+    }
+  });
+  e_graph.end_concurrent();
+  return timer.seconds();
+}
+
+int main(int argc, char** argv) {
+  size_t size = max_size(argc, argv, 1000000);
+  size_t max_threads = std::max(size_t(std::thread::hardware_concurrency()), size_t(1));
+  
+  std::cout << std::setw(12) << "threads"
+            << std::setw(12) << "nodes"
+            << std::setw(16) << "ms"
+            << std::setw(12) << "speedup" << std::endl;
+  
+  std::vector<size_t> thread_counts;
+  for (size_t threads = 1; threads < max_threads; threads *= 2) {
+    thread_counts.push_back(threads);
+  }
+  thread_counts.push_back(max_threads);
+  
+  double base_time = run_sequential(size);
+  std::cout << std::setw(12) << "node()"
+            << std::setw(12) << size
+            << std::setw(16) << std::fixed << std::setprecision(3) << base_time * 1e3
+            << std::setw(12) << std::setprecision(2) << 1.0 << std::endl;
+  
+  for (size_t threads : thread_counts) {
+    double time = run(size, threads);
+    std::cout << std::setw(12) << threads
+              << std::setw(12) << size
+              << std::setw(16) << std::fixed << std::setprecision(3) << time * 1e3
+              << std::setw(12) << std::setprecision(2) << base_time / time << std::endl;
+  }
+  
+  return 0;
+}
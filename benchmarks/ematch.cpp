@@ -0,0 +1,95 @@
+// Copyright 2024 Can Joshua Lehmann
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Compares backtracking e-matching (EGraph::Program) with relational
+// e-matching (EGraph::Query) on the pattern Add(?x, Neg(?x)).
+// All Neg nodes are merged into a single equivalence class, so
+// backtracking visits every Neg node for every Add node.
+
+#include <vector>
+
+#include "benchmark.hpp"
+
+using namespace benchmark;
+
+using EGraph = egraphs::EGraph<NodeKind, NodeData>;
+using Node = EGraph::Node;
+using Pattern = EGraph::Pattern;
+
+void build(EGraph& e_graph, size_t size) {
+  std::vector<Node*> values;
+  for (size_t it = 0; it < size; it++) {
+    values.push_back(e_graph.node(NodeData(it)));
+  }
+  
+  EGraph::MergeQueue queue;
+  Node* negs = e_graph.node(NodeKind::Neg, {values[0]});
+  for (Node* value : values) {
+    queue.merge(negs, e_graph.node(NodeKind::Neg, {value}));
+  }
+  e_graph.merge(queue);
+  
+  Random random;
+  for (Node* value : values) {
+    e_graph.node(NodeKind::Add, {value, negs->root()});
+    e_graph.node(NodeKind::Add, {value, values[random.next(values.size())]});
+  }
+}
+
+int main(int argc, char** argv) {
+  size_t max = max_size(argc, argv, 16000);
+  
+  Pattern pattern(NodeKind::Add, {
+    Pattern::var(0),
+    Pattern(NodeKind::Neg, {Pattern::var(0)})
+  });
+  EGraph::Program program(pattern);
+  EGraph::Query query(pattern);
+  
+  std::cout << std::setw(12) << "values"
+            << std::setw(12) << "matches"
+            << std::setw(16) << "program ms"
+            << std::setw(16) << "query ms" << std::endl;
+  
+  for (size_t size = 1000; size <= max; size *= 2) {
+    EGraph e_graph;
+    build(e_graph, size);
+    
+    size_t program_matches = 0;
+    Timer program_timer;
+    program.search(e_graph, [&](Node* root, const std::vector<Node*>& subst){
+      program_matches++;
+    });
+    double program_time = program_timer.seconds();
+    
+    size_t query_matches = 0;
+    Timer query_timer;
+    query.search(e_graph, [&](Node* root, const std::vector<Node*>& subst){
+      query_matches++;
+    });
+    double query_time = query_timer.seconds();
+    
+    if (program_matches != query_matches) {
+      std::cerr << "Mismatch" << std::endl;
+      return 1;
+    }
+    
+    std::cout << std::setw(12) << size
+              << std::setw(12) << query_matches
+              << std::setw(16) << std::fixed << std::setprecision(3) << program_time * 1e3
+              << std::setw(16) << query_time * 1e3 << std::endl;
+  }
+  
+  return 0;
+}
@@ -0,0 +1,211 @@
+// Copyright 2024 Can Joshua Lehmann
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Compares extraction with dense class indices (EGraph::extract) with
+// the previous approach which stored costs and representatives in
+// hash maps keyed by root nodes, and with parallel extraction using
+// all hardware threads.
+
+#include <vector>
+#include <queue>
+#include <unordered_map>
+
+#include "benchmark.hpp"
+
+using namespace benchmark;
+
+using EGraph = egraphs::EGraph<NodeKind, NodeData>;
+using Node = EGraph::Node;
+using Cost = EGraph::Cost;
+
+// Builds layers of binary nodes over a set of leaves and merges
+// random pairs of nodes within each layer
+void build(EGraph& e_graph, size_t size) {
+  std::vector<Node*> layer;
+  for (size_t it = 0; it < size / 4; it++) {
+    layer.push_back(e_graph.node(NodeData(it)));
+  }
+  
+  Random random(1);
+  EGraph::MergeQueue queue;
+  for (size_t depth = 0; depth < 4; depth++) {
+    for (size_t it = 0; it < layer.size() / 8; it++) {
+      queue.merge(
+        layer[random.next(layer.size())],
+        layer[random.next(layer.size())]
+      );
+    }
+    
+    if (depth < 3) {
+      std::vector<Node*> next;
+      for (size_t it = 0; it < size / 4; it++) {
+        NodeKind kind = random.next(2) == 0 ? NodeKind::Add : NodeKind::Mul;
+        next.push_back(e_graph.node(kind, {
+          layer[random.next(layer.size())],
+          layer[random.next(layer.size())]
+        }));
+      }
+      layer = next;
+    }
+  }
+  e_graph.merge(queue);
+}
+
+using LegacyCosts = std::unordered_map<Node*, Cost>;
+using LegacyExtracted = std::unordered_map<Node*, Node*>;
+using Users = std::unordered_map<Node*, std::vector<Node*>>;
+
+Users collect_users(EGraph& e_graph) {
+  Users users;
+  for (Node* root : e_graph.roots()) {
+    for (Node* node : root->e_class()) {
+      for (Node* child : *node) {
+        users[child->root()].push_back(node);
+      }
+    }
+  }
+  return users;
+}
+
+// Dijkstra based extraction using hash maps, as implemented by
+// EGraph::extract before class indices were introduced
+LegacyExtracted extract_legacy(EGraph& e_graph, const Users& users) {
+  std::function<Cost(Node*, const LegacyCosts&)> cost_fn = [](Node* node, const LegacyCosts& costs){
+    Cost cost = 1;
+    for (Node* child : *node) {
+      cost += costs.at(child->root());
+    }
+    return cost;
+  };
+  
+  using QueueItem = std::pair<uint64_t, Node*>;
+  std::priority_queue<QueueItem, std::vector<QueueItem>, std::greater<QueueItem>> queue;
+  LegacyExtracted extracted;
+  LegacyCosts costs;
+  
+  for (Node* root : e_graph.roots()) {
+    extracted.insert({root, root});
+    costs.insert({root, Cost::inf()});
+  }
+  
+  for (Node* root : e_graph.roots()) {
+    for (Node* node : root->e_class()) {
+      if (node->size() == 0) {
+        Cost cost = cost_fn(node, costs);
+        if (cost < costs.at(root)) {
+          queue.push({cost.value(), root});
+          extracted.at(root) = node;
+          costs.at(root) = cost;
+        }
+      }
+    }
+  }
+  
+  while (!queue.empty()) {
+    auto [cost_value, root] = queue.top();
+    queue.pop();
+    if (Cost(cost_value) != costs.at(root)) {
+      continue;
+    }
+    auto users_it = users.find(root);
+    if (users_it == users.end()) {
+      continue;
+    }
+    for (Node* node : users_it->second) {
+      Cost cost = cost_fn(node, costs);
+      Node* user_root = node->root();
+      if (cost < costs.at(user_root)) {
+        queue.push({cost.value(), user_root});
+        extracted.at(user_root) = node;
+        costs.at(user_root) = cost;
+      }
+    }
+  }
+  
+  return extracted;
+}
+
+// Total cost of the extracted terms, used to check that both
+// implementations find equally good representatives
+template <class Extracted>
+uint64_t total_cost(EGraph& e_graph, const Extracted& extracted) {
+  std::unordered_map<Node*, uint64_t> costs;
+  std::function<uint64_t(Node*)> cost = [&](Node* root) -> uint64_t {
+    auto it = costs.find(root);
+    if (it != costs.end()) {
+      return it->second;
+    }
+    uint64_t result = 1;
+    for (Node* child : *extracted.at(root)) {
+      result += cost(child->root());
+    }
+    costs.insert({root, result});
+    return result;
+  };
+  
+  uint64_t total = 0;
+  for (Node* root : e_graph.roots()) {
+    total += cost(root);
+  }
+  return total;
+}
+
+int main(int argc, char** argv) {
+  size_t max = max_size(argc, argv, 1 << 21);
+  egraphs::ThreadPool pool;
+  
+  std::cout << std::setw(12) << "nodes"
+            << std::setw(12) << "classes"
+            << std::setw(16) << "map ms"
+            << std::setw(16) << "vector ms"
+            << std::setw(16) << "parallel ms" << std::endl;
+  
+  for (size_t size = 1 << 15; size <= max; size *= 4) {
+    EGraph e_graph;
+    build(e_graph, size);
+    Users users = collect_users(e_graph);
+    
+    Timer legacy_timer;
+    LegacyExtracted legacy = extract_legacy(e_graph, users);
+    double legacy_time = legacy_timer.seconds();
+    
+    Timer timer;
+    EGraph::Extracted extracted = e_graph.extract();
+    double time = timer.seconds();
+    
+    Timer parallel_timer;
+    EGraph::Extracted parallel = e_graph.extract(pool);
+    double parallel_time = parallel_timer.seconds();
+    
+    if (total_cost(e_graph, legacy) != total_cost(e_graph, extracted)) {
+      std::cerr << "Mismatch" << std::endl;
+      return 1;
+    }
+    
+    for (size_t it = 0; it < extracted.size(); it++) {
+      if (extracted[it] != parallel[it]) {
+        std::cerr << "Mismatch" << std::endl;
+        return 1;
+      }
+    }
+    
+    std::cout << std::setw(12) << e_graph.node_count()
+              << std::setw(12) << e_graph.roots().size()
+              << std::setw(16) << std::fixed << std::setprecision(3) << legacy_time * 1e3
+              << std::setw(16) << time * 1e3
+              << std::setw(16) << parallel_time * 1e3 << std::endl;
+  }
+  
+  return 0;
+}
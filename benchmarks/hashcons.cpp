@@ -0,0 +1,86 @@
+// Copyright 2024 Can Joshua Lehmann
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Measures the latency of EGraph::node lookups for already existing
+// nodes as the e-graph grows.
+
+#include <vector>
+
+#include "benchmark.hpp"
+
+using namespace benchmark;
+
+template <template <class> class Hashcons>
+bool run(const char* name, size_t max) {
+  using EGraph = egraphs::EGraph<NodeKind, NodeData, Hashcons>;
+  using Node = typename EGraph::Node;
+  
+  const size_t LOOKUPS = 1000000;
+  
+  std::cout << name << std::endl;
+  std::cout << std::setw(12) << "nodes"
+            << std::setw(16) << "insert ns/node"
+            << std::setw(18) << "lookup ns/node" << std::endl;
+  
+  for (size_t size = 1000; size <= max; size *= 10) {
+    EGraph e_graph;
+    std::vector<Node*> leaves;
+    
+    // Half of the nodes are leaves, the other half are unary nodes
+    // with a leaf child.
+    Timer insert_timer;
+    for (size_t it = 0; it < size / 2; it++) {
+      leaves.push_back(e_graph.node(NodeData(it)));
+    }
+    for (Node* leaf : leaves) {
+      e_graph.node(NodeKind::Neg, {leaf});
+    }
+    double insert_time = insert_timer.seconds();
+    
+    Random random;
+    size_t found = 0;
+    Timer lookup_timer;
+    for (size_t it = 0; it < LOOKUPS; it++) {
+      Node* leaf = leaves[random.next(leaves.size())];
+      if (it % 2 == 0) {
+        found += e_graph.node(NodeData(leaf->data().value())) == leaf;
+      } else {
+        found += e_graph.node(NodeKind::Neg, {leaf}) != nullptr;
+      }
+    }
+    double lookup_time = lookup_timer.seconds();
+    
+    if (found != LOOKUPS) {
+      std::cerr << "Lookup failed" << std::endl;
+      return false;
+    }
+    
+    std::cout << std::setw(12) << size
+              << std::setw(16) << std::fixed << std::setprecision(1) << insert_time * 1e9 / size
+              << std::setw(18) << lookup_time * 1e9 / LOOKUPS << std::endl;
+  }
+  
+  return true;
+}
+
+int main(int argc, char** argv) {
+  size_t max = max_size(argc, argv, 10000000);
+  
+  if (!run<egraphs::ChainedHashcons>("ChainedHashcons", max) ||
+      !run<egraphs::SwissHashcons>("SwissHashcons", max)) {
+    return 1;
+  }
+  
+  return 0;
+}
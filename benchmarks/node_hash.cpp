@@ -0,0 +1,93 @@
+// Copyright 2024 Can Joshua Lehmann
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Compares the distribution of nodes in the hashcons for the default
+// NodeHasher and the previous order insensitive XOR based node hash.
+// The workload contains both argument orders of commutative operators.
+
+#include <vector>
+
+#include "benchmark.hpp"
+
+using namespace benchmark;
+
+// Previous node hash: XOR of the data hash and the child pointers
+struct LegacyNodeHasher {
+  template <class NodeData>
+  static inline size_t data(const NodeData& data, size_t child_count) {
+    return std::hash<NodeData>()(data) ^ (std::hash<size_t>()(child_count) << 17);
+  }
+  
+  static inline size_t child(const void* child, size_t index) {
+    return std::hash<const void*>()(child);
+  }
+  
+  static inline size_t finish(size_t hash) {
+    return hash;
+  }
+};
+
+template <class Hasher>
+void run(const char* name, size_t size) {
+  using EGraph = egraphs::EGraph<NodeKind, NodeData, egraphs::ChainedHashcons, Hasher>;
+  using Node = typename EGraph::Node;
+  
+  EGraph e_graph;
+  std::vector<Node*> leaves;
+  for (size_t it = 0; it < 1000; it++) {
+    leaves.push_back(e_graph.node(NodeData(it)));
+  }
+  
+  Random random;
+  std::vector<Node*> nodes;
+  while (e_graph.hashcons().size() < size) {
+    Node* a = leaves[random.next(leaves.size())];
+    Node* b = leaves[random.next(leaves.size())];
+    if (!nodes.empty()) {
+      a = nodes[random.next(nodes.size())];
+    }
+    NodeKind kind = random.next(2) == 0 ? NodeKind::Add : NodeKind::Mul;
+    nodes.push_back(e_graph.node(kind, {a, b}));
+    nodes.push_back(e_graph.node(kind, {b, a}));
+  }
+  
+  Timer timer;
+  size_t found = 0;
+  for (Node* node : nodes) {
+    found += e_graph.node(node->data(), {node->at(0), node->at(1)}) == node;
+  }
+  double time = timer.seconds();
+  
+  std::cout << std::setw(20) << name
+            << std::setw(12) << e_graph.hashcons().size()
+            << std::setw(14) << std::fixed << std::setprecision(2) << e_graph.hashcons().average_chain_length()
+            << std::setw(18) << std::setprecision(1) << time * 1e9 / nodes.size()
+            << (found == nodes.size() ? "" : " (lookup failed)") << std::endl;
+}
+
+int main(int argc, char** argv) {
+  size_t max = max_size(argc, argv, 1000000);
+  
+  std::cout << std::setw(20) << "hasher"
+            << std::setw(12) << "nodes"
+            << std::setw(14) << "avg chain"
+            << std::setw(18) << "lookup ns/node" << std::endl;
+  
+  for (size_t size = 10000; size <= max; size *= 10) {
+    run<LegacyNodeHasher>("LegacyNodeHasher", size);
+    run<egraphs::NodeHasher>("NodeHasher", size);
+  }
+  
+  return 0;
+}
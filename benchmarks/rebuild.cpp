@@ -0,0 +1,133 @@
+// Copyright 2024 Can Joshua Lehmann
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Compares eager congruence repair (merge) with deferred merging
+// followed by a single rebuild per batch of merges.
+
+#include <vector>
+
+#include "benchmark.hpp"
+
+using namespace benchmark;
+
+using EGraph = egraphs::EGraph<NodeKind, NodeData>;
+using Node = EGraph::Node;
+
+// Builds layers of binary nodes over a set of leaves
+std::vector<Node*> build(EGraph& e_graph, size_t size) {
+  std::vector<Node*> leaves;
+  for (size_t it = 0; it < size / 4; it++) {
+    leaves.push_back(e_graph.node(NodeData(it)));
+  }
+  
+  Random random(1);
+  std::vector<Node*> layer = leaves;
+  for (size_t depth = 0; depth < 3; depth++) {
+    std::vector<Node*> next;
+    for (size_t it = 0; it < size / 4; it++) {
+      NodeKind kind = random.next(2) == 0 ? NodeKind::Add : NodeKind::Mul;
+      next.push_back(e_graph.node(kind, {
+        layer[random.next(layer.size())],
+        layer[random.next(layer.size())]
+      }));
+    }
+    layer = next;
+  }
+  
+  return leaves;
+}
+
+// Random merges of unrelated leaves
+void random_merges(const std::vector<Node*>& leaves, Random& random, EGraph::MergeQueue& queue) {
+  for (size_t it = 0; it < leaves.size() / 16; it++) {
+    queue.merge(
+      leaves[random.next(leaves.size())],
+      leaves[random.next(leaves.size())]
+    );
+  }
+}
+
+// Merges leaves into groups of 64 consecutive leaves in random order.
+// Classes grow gradually and are merged multiple times per batch, which
+// causes the eager strategy to repair the same users repeatedly.
+void group_merges(const std::vector<Node*>& leaves, Random& random, EGraph::MergeQueue& queue) {
+  std::vector<size_t> order;
+  for (size_t it = 0; it + 1 < leaves.size(); it++) {
+    if ((it + 1) % 64 != 0) {
+      order.push_back(it);
+    }
+  }
+  for (size_t it = order.size(); it > 1; it--) {
+    std::swap(order[it - 1], order[random.next(it)]);
+  }
+  for (size_t index : order) {
+    queue.merge(leaves[index], leaves[index + 1]);
+  }
+}
+
+template <class Workload, class Fn>
+void run(const char* workload_name,
+         const char* name,
+         size_t size,
+         size_t rounds,
+         const Workload& workload,
+         const Fn& merge) {
+  EGraph e_graph;
+  std::vector<Node*> leaves = build(e_graph, size);
+  
+  Random random(2);
+  double time = 0;
+  for (size_t round = 0; round < rounds; round++) {
+    EGraph::MergeQueue queue;
+    workload(leaves, random, queue);
+    
+    Timer timer;
+    merge(e_graph, queue);
+    time += timer.seconds();
+  }
+  
+  std::cout << std::setw(10) << workload_name
+            << std::setw(10) << name
+            << std::setw(12) << size
+            << std::setw(12) << e_graph.roots().size()
+            << std::setw(12) << std::fixed << std::setprecision(2) << time * 1e3 << std::endl;
+}
+
+int main(int argc, char** argv) {
+  size_t max = max_size(argc, argv, 1000000);
+  
+  std::cout << std::setw(10) << "workload"
+            << std::setw(10) << "mode"
+            << std::setw(12) << "nodes"
+            << std::setw(12) << "classes"
+            << std::setw(12) << "ms" << std::endl;
+  
+  auto eager = [](EGraph& e_graph, EGraph::MergeQueue& queue){
+    e_graph.merge(queue);
+  };
+  
+  auto deferred = [](EGraph& e_graph, EGraph::MergeQueue& queue){
+    e_graph.merge_deferred(queue);
+    e_graph.rebuild();
+  };
+  
+  for (size_t size = 10000; size <= max; size *= 10) {
+    run("random", "eager", size, 8, random_merges, eager);
+    run("random", "deferred", size, 8, random_merges, deferred);
+    run("groups", "eager", size, 1, group_merges, eager);
+    run("groups", "deferred", size, 1, group_merges, deferred);
+  }
+  
+  return 0;
+}
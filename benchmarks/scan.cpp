@@ -0,0 +1,105 @@
+// Copyright 2024 Can Joshua Lehmann
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Compares finding all nodes of one kind by iterating roots() and their
+// equivalence classes with EGraph::scan.
+
+#include <vector>
+
+#include "benchmark.hpp"
+
+using namespace benchmark;
+
+using EGraph = egraphs::EGraph<NodeKind, NodeData>;
+using Node = EGraph::Node;
+
+void build(EGraph& e_graph, size_t size) {
+  std::vector<Node*> nodes;
+  for (size_t it = 0; it < size / 4; it++) {
+    nodes.push_back(e_graph.node(NodeData(it)));
+  }
+  
+  Random random;
+  while (e_graph.node_count() < size) {
+    NodeKind kind = NodeKind::Add;
+    switch (random.next(8)) {
+      case 0: kind = NodeKind::Mul; break;
+      case 1: kind = NodeKind::Neg; break;
+    }
+    if (kind == NodeKind::Neg) {
+      nodes.push_back(e_graph.node(kind, {nodes[random.next(nodes.size())]->root()}));
+    } else {
+      nodes.push_back(e_graph.node(kind, {
+        nodes[random.next(nodes.size())]->root(),
+        nodes[random.next(nodes.size())]->root()
+      }));
+    }
+  }
+  
+  // Build larger equivalence classes
+  EGraph::MergeQueue queue;
+  for (size_t it = 0; it < size / 8; it++) {
+    queue.merge(nodes[random.next(nodes.size())], nodes[random.next(nodes.size())]);
+  }
+  e_graph.merge(queue);
+}
+
+int main(int argc, char** argv) {
+  size_t max = max_size(argc, argv, 1000000);
+  const size_t REPEAT = 10;
+  
+  std::cout << std::setw(12) << "nodes"
+            << std::setw(12) << "matches"
+            << std::setw(16) << "classes ms"
+            << std::setw(16) << "scan ms" << std::endl;
+  
+  for (size_t size = 10000; size <= max; size *= 10) {
+    EGraph e_graph;
+    build(e_graph, size);
+    
+    size_t class_matches = 0;
+    Timer class_timer;
+    for (size_t it = 0; it < REPEAT; it++) {
+      for (Node* root : e_graph.roots()) {
+        for (Node* node : root->e_class()) {
+          if (node->data().kind() == NodeKind::Mul) {
+            class_matches++;
+          }
+        }
+      }
+    }
+    double class_time = class_timer.seconds() / REPEAT;
+    
+    size_t scan_matches = 0;
+    Timer scan_timer;
+    for (size_t it = 0; it < REPEAT; it++) {
+      e_graph.scan(NodeKind::Mul, [&](Node* node){
+        scan_matches++;
+      });
+    }
+    double scan_time = scan_timer.seconds() / REPEAT;
+    
+    if (class_matches != scan_matches) {
+      std::cerr << "Mismatch" << std::endl;
+      return 1;
+    }
+    
+    std::cout << std::setw(12) << size
+              << std::setw(12) << scan_matches / REPEAT
+              << std::setw(16) << std::fixed << std::setprecision(3) << class_time * 1e3
+              << std::setw(16) << scan_time * 1e3 << std::endl;
+  }
+  
+  return 0;
+}
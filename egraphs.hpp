@@ -17,6 +17,7 @@
 
 #include <vector>
 #include <deque>
+#include <algorithm>
 #include <queue>
 #include <unordered_set>
 #include <unordered_map>
@@ -25,10 +26,26 @@
 #include <stdexcept>
 #include <functional>
 #include <utility>
+#include <optional>
+#include <string>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <type_traits>
+#include <iterator>
 
 #include <cassert>
 #include <cinttypes>
 
+#if defined(__AVX2__)
+  #include <immintrin.h>
+#elif defined(__SSE2__)
+  #include <emmintrin.h>
+#endif
+
 #define throw_error(Error, msg) { \
   std::ostringstream message_stream; \
   message_stream << msg; \
@@ -103,6 +120,13 @@ namespace egraphs {
     T* alloc() {
       return (T*)alloc(sizeof(T), alignof(T));
     }
+    
+    // Number of bytes allocated so far, including padding and the
+    // unused ends of full arenas.
+    size_t size() const {
+      const Arena& arena = _arenas.back();
+      return (_arenas.size() - 1) * Arena::SIZE + size_t(arena.top - (uintptr_t)arena.data);
+    }
   };
   
   template <class NodeKind>
@@ -123,6 +147,12 @@ namespace egraphs {
     }
   };
   
+  template <class NodeKind>
+  std::ostream& operator<<(std::ostream& stream, const SimpleNodeData<NodeKind>& data) {
+    stream << data.kind();
+    return stream;
+  }
+  
 }
 
 template <class NodeKind>
@@ -133,10 +163,715 @@ struct std::hash<egraphs::SimpleNodeData<NodeKind>> {
 };
 
 namespace egraphs {
-  template <class NodeKind, class NodeData = SimpleNodeData<NodeKind>>
+  // Hash function for nodes.
+  // The hash of a node is computed as
+  //   finish(data(data, child_count) ^ child(children[0], 0) ^ ... ^ child(children[n - 1], n - 1))
+  // Since the child index is part of the hashed value, the hash is
+  // sensitive to the order of children.
+  // The mixing function is the multiply-xorshift from wyhash.
+  struct NodeHasher {
+    static constexpr const uint64_t SECRET0 = 0xa0761d6478bd642f;
+    static constexpr const uint64_t SECRET1 = 0xe7037ed1a0b428db;
+    static constexpr const uint64_t SECRET2 = 0x8ebc6af09c88c6e3;
+    static constexpr const uint64_t SECRET3 = 0x589965cc75374cc3;
+    
+    static inline uint64_t mix(uint64_t a, uint64_t b) {
+      __uint128_t product = __uint128_t(a) * __uint128_t(b);
+      return uint64_t(product) ^ uint64_t(product >> 64);
+    }
+    
+    template <class NodeData>
+    static inline size_t data(const NodeData& data, size_t child_count) {
+      return mix(std::hash<NodeData>()(data) ^ SECRET0, uint64_t(child_count) ^ SECRET1);
+    }
+    
+    static inline size_t child(const void* child, size_t index) {
+      return mix(uint64_t(uintptr_t(child)) ^ SECRET2, SECRET1 + uint64_t(index) * SECRET3);
+    }
+    
+    static inline size_t finish(size_t hash) {
+      return mix(uint64_t(hash) ^ SECRET3, SECRET0);
+    }
+  };
+  
+  // Hashcons using intrusive bucket chains.
+  // The table doubles in size once the load factor exceeds MAX_LOAD.
+  // Growing is incremental: The previous table is kept alive and a few
+  // of its buckets are migrated to the new table on every insertion,
+  // so no single operation has to rehash all nodes.
+  template <class Node>
+  class ChainedHashcons {
+  public:
+    struct Link {
+      Node* next = nullptr;
+      Node** prev = nullptr;
+      
+      bool is_linked() const { return prev != nullptr; }
+    };
+  private:
+    static constexpr const size_t INITIAL_SIZE = 1024;
+    static constexpr const size_t MAX_LOAD = 1;
+    static constexpr const size_t MIGRATE_STEP = 4;
+    
+    Node** _data = nullptr;
+    size_t _size = 0;
+    size_t _count = 0;
+    
+    // Table which is currently being migrated to _data.
+    // All buckets with an index below _migrated are already empty.
+    Node** _old_data = nullptr;
+    size_t _old_size = 0;
+    size_t _migrated = 0;
+    
+    // Bucket which contains nodes with the given hash.
+    // Buckets of the old table are used until they are migrated.
+    Node** bucket(size_t hash) {
+      if (_old_data != nullptr) {
+        size_t index = hash & (_old_size - 1);
+        if (index >= _migrated) {
+          return &_old_data[index];
+        }
+      }
+      return &_data[hash & (_size - 1)];
+    }
+    
+    static void link(Node** bucket, Node* node) {
+      node->_hashcons_link.next = *bucket;
+      if (*bucket != nullptr) {
+        (*bucket)->_hashcons_link.prev = &node->_hashcons_link.next;
+      }
+      *bucket = node;
+      node->_hashcons_link.prev = bucket;
+    }
+    
+    // Moves up to `steps` buckets from the old table to the new table.
+    void migrate(size_t steps) {
+      while (_old_data != nullptr && steps > 0) {
+        Node* node = _old_data[_migrated];
+        _old_data[_migrated] = nullptr;
+        while (node != nullptr) {
+          Node* next = node->_hashcons_link.next;
+          link(&_data[node->hash() & (_size - 1)], node);
+          node = next;
+        }
+        
+        _migrated++;
+        steps--;
+        if (_migrated == _old_size) {
+          delete[] _old_data;
+          _old_data = nullptr;
+          _old_size = 0;
+          _migrated = 0;
+        }
+      }
+    }
+    
+    void grow() {
+      migrate(_old_size);
+      
+      _old_data = _data;
+      _old_size = _size;
+      _migrated = 0;
+      
+      _size *= 2;
+      _data = new Node*[_size]();
+    }
+  public:
+    ChainedHashcons() {
+      _size = INITIAL_SIZE;
+      _data = new Node*[_size]();
+    }
+    
+    owned(ChainedHashcons)
+    
+    ~ChainedHashcons() {
+      delete[] _data;
+      delete[] _old_data;
+    }
+    
+    inline size_t size() const { return _count; }
+    inline size_t bucket_count() const { return _size; }
+    
+    // Average length of the chain which contains a node.
+    // This is the expected number of nodes visited by a successful lookup.
+    double average_chain_length() const {
+      size_t sum = 0;
+      auto add_chains = [&](Node** data, size_t size){
+        for (size_t it = 0; it < size; it++) {
+          size_t length = 0;
+          for (Node* node = data[it]; node != nullptr; node = node->_hashcons_link.next) {
+            length++;
+          }
+          sum += length * length;
+        }
+      };
+      add_chains(_data, _size);
+      add_chains(_old_data, _old_size);
+      return _count == 0 ? 0.0 : double(sum) / double(_count);
+    }
+    
+    template <class NodeData>
+    Node* get(size_t hash, const NodeData& data, Node** children, size_t child_count) {
+      Node* node = *bucket(hash);
+      while (node != nullptr) {
+        if (node->eq(data, children, child_count)) {
+          return node;
+        }
+        node = node->_hashcons_link.next;
+      }
+      return nullptr;
+    }
+    
+    Node* get(Node* node) {
+      return get(node->hash(), node->_data, node->_children, node->_child_count);
+    }
+    
+    // Removes a node from the hashcons.
+    // Assumes that the node is currently in the hashcons.
+    void erase(Node* node) {
+      assert(node->is_in_hashcons());
+      
+      *node->_hashcons_link.prev = node->_hashcons_link.next;
+      if (node->_hashcons_link.next != nullptr) {
+        node->_hashcons_link.next->_hashcons_link.prev = node->_hashcons_link.prev;
+      }
+      node->_hashcons_link.next = nullptr;
+      node->_hashcons_link.prev = nullptr;
+      _count--;
+    }
+    
+    // Assumes that node is not currently in the hashcons.
+    void insert(Node* node) {
+      assert(!node->is_in_hashcons());
+      
+      _count++;
+      if (_count > _size * MAX_LOAD) {
+        grow();
+      }
+      migrate(MIGRATE_STEP);
+      
+      link(bucket(node->hash()), node);
+    }
+    
+    // Concurrent insertion
+    // After reserve(count), up to count nodes may be inserted using
+    // insert_concurrent without resizing the table. Operations on
+    // hashes in different stripes may run concurrently.
+    // end_concurrent must be called with the number of inserted nodes
+    // before any other modification.
+    
+    void reserve(size_t count) {
+      while (_count + count > _size * MAX_LOAD) {
+        grow();
+      }
+      migrate(_old_size);
+    }
+    
+    inline size_t stripe(size_t hash) const {
+      assert(_old_data == nullptr);
+      return hash & (_size - 1);
+    }
+    
+    void insert_concurrent(Node* node) {
+      assert(!node->is_in_hashcons());
+      link(&_data[stripe(node->hash())], node);
+    }
+    
+    void end_concurrent(size_t count) {
+      _count += count;
+    }
+  };
+  
+  // Open addressing hashcons in the style of Swiss tables.
+  // Slots are grouped and every slot has a control byte which is either
+  // EMPTY, DELETED or stores 7 bits of the hash of the node in the slot.
+  // Lookups compare the control bytes of a whole group at once (using
+  // SSE2 or AVX2 if available) and only access nodes whose hash bits match.
+  template <class Node>
+  class SwissHashcons {
+  public:
+    struct Link {
+      static constexpr const size_t NONE = ~size_t(0);
+      
+      size_t slot = NONE;
+      
+      bool is_linked() const { return slot != NONE; }
+    };
+  private:
+    static constexpr const uint8_t EMPTY = 0x80;
+    static constexpr const uint8_t DELETED = 0xfe;
+    
+    // Bit i of a mask is set if the condition holds for slot i of the group
+    class Group {
+    public:
+#if defined(__AVX2__)
+      static constexpr const size_t SIZE = 32;
+    private:
+      __m256i _control;
+    public:
+      explicit Group(const uint8_t* control):
+        _control(_mm256_loadu_si256((const __m256i*)control)) {}
+      
+      uint32_t match(uint8_t byte) const {
+        return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_control, _mm256_set1_epi8((char)byte)));
+      }
+      
+      // Slots are free if they are EMPTY or DELETED.
+      // Only these control bytes have their highest bit set.
+      uint32_t match_free() const {
+        return (uint32_t)_mm256_movemask_epi8(_control);
+      }
+#elif defined(__SSE2__)
+      static constexpr const size_t SIZE = 16;
+    private:
+      __m128i _control;
+    public:
+      explicit Group(const uint8_t* control):
+        _control(_mm_loadu_si128((const __m128i*)control)) {}
+      
+      uint32_t match(uint8_t byte) const {
+        return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_control, _mm_set1_epi8((char)byte)));
+      }
+      
+      uint32_t match_free() const {
+        return (uint32_t)_mm_movemask_epi8(_control);
+      }
+#else
+      static constexpr const size_t SIZE = 16;
+    private:
+      const uint8_t* _control;
+    public:
+      explicit Group(const uint8_t* control): _control(control) {}
+      
+      uint32_t match(uint8_t byte) const {
+        uint32_t mask = 0;
+        for (size_t it = 0; it < SIZE; it++) {
+          mask |= uint32_t(_control[it] == byte) << it;
+        }
+        return mask;
+      }
+      
+      uint32_t match_free() const {
+        uint32_t mask = 0;
+        for (size_t it = 0; it < SIZE; it++) {
+          mask |= uint32_t(_control[it] >> 7) << it;
+        }
+        return mask;
+      }
+#endif
+      uint32_t match_empty() const { return match(EMPTY); }
+    };
+    
+    static constexpr const size_t INITIAL_CAPACITY = 1024;
+    
+    uint8_t* _control = nullptr;
+    Node** _slots = nullptr;
+    size_t _capacity = 0;
+    size_t _count = 0;
+    size_t _used = 0; // Number of slots which are not EMPTY
+    
+    static inline uint8_t tag(size_t hash) {
+      return uint8_t(hash >> (sizeof(size_t) * 8 - 7));
+    }
+    
+    inline size_t group_mask() const {
+      return _capacity / Group::SIZE - 1;
+    }
+    
+    void allocate(size_t capacity) {
+      _capacity = capacity;
+      _control = new uint8_t[_capacity];
+      std::fill(_control, _control + _capacity, EMPTY);
+      _slots = new Node*[_capacity]();
+      _used = 0;
+    }
+    
+    // Stores node in the first free slot of its probe sequence
+    void place(Node* node, size_t hash) {
+      size_t group = hash & group_mask();
+      for (size_t step = 1; ; step++) {
+        uint32_t free = Group(&_control[group * Group::SIZE]).match_free();
+        if (free != 0) {
+          size_t slot = group * Group::SIZE + __builtin_ctz(free);
+          if (_control[slot] == EMPTY) {
+            _used++;
+          }
+          _control[slot] = tag(hash);
+          _slots[slot] = node;
+          node->_hashcons_link.slot = slot;
+          return;
+        }
+        group = (group + step) & group_mask();
+      }
+    }
+    
+    // Reinserts all nodes into a table of the given capacity.
+    // This also removes all DELETED control bytes.
+    void rehash(size_t capacity) {
+      uint8_t* control = _control;
+      Node** slots = _slots;
+      size_t old_capacity = _capacity;
+      
+      allocate(capacity);
+      for (size_t it = 0; it < old_capacity; it++) {
+        if (!(control[it] & 0x80)) {
+          place(slots[it], slots[it]->hash());
+        }
+      }
+      
+      delete[] control;
+      delete[] slots;
+    }
+  public:
+    SwissHashcons() {
+      allocate(INITIAL_CAPACITY);
+    }
+    
+    owned(SwissHashcons)
+    
+    ~SwissHashcons() {
+      delete[] _control;
+      delete[] _slots;
+    }
+    
+    inline size_t size() const { return _count; }
+    inline size_t bucket_count() const { return _capacity; }
+    
+    template <class NodeData>
+    Node* get(size_t hash, const NodeData& data, Node** children, size_t child_count) {
+      uint8_t hash_tag = tag(hash);
+      size_t group = hash & group_mask();
+      // Triangular probing over groups visits every group exactly once,
+      // since the number of groups is a power of two.
+      for (size_t step = 1; ; step++) {
+        Group control(&_control[group * Group::SIZE]);
+        uint32_t matches = control.match(hash_tag);
+        while (matches != 0) {
+          Node* node = _slots[group * Group::SIZE + __builtin_ctz(matches)];
+          if (node->eq(data, children, child_count)) {
+            return node;
+          }
+          matches &= matches - 1;
+        }
+        if (control.match_empty() != 0) {
+          return nullptr;
+        }
+        group = (group + step) & group_mask();
+      }
+    }
+    
+    Node* get(Node* node) {
+      return get(node->hash(), node->_data, node->_children, node->_child_count);
+    }
+    
+    // Removes a node from the hashcons.
+    // Assumes that the node is currently in the hashcons.
+    void erase(Node* node) {
+      assert(node->is_in_hashcons());
+      
+      size_t slot = node->_hashcons_link.slot;
+      size_t group = slot / Group::SIZE * Group::SIZE;
+      // Probing stops at the first group containing an EMPTY slot, so
+      // if the group already contains one, no probe sequence continues
+      // past this slot and it can be marked as EMPTY again.
+      if (Group(&_control[group]).match_empty() != 0) {
+        _control[slot] = EMPTY;
+        _used--;
+      } else {
+        _control[slot] = DELETED;
+      }
+      _slots[slot] = nullptr;
+      node->_hashcons_link.slot = Link::NONE;
+      _count--;
+    }
+    
+    // Assumes that node is not currently in the hashcons.
+    void insert(Node* node) {
+      assert(!node->is_in_hashcons());
+      
+      // Keep the load factor (including DELETED slots) below 7/8
+      if ((_used + 1) * 8 > _capacity * 7) {
+        if ((_count + 1) * 16 > _capacity * 7) {
+          rehash(_capacity * 2);
+        } else {
+          rehash(_capacity);
+        }
+      }
+      
+      place(node, node->hash());
+      _count++;
+    }
+    
+    // Concurrent insertion (see ChainedHashcons::reserve)
+    // Since probe sequences cross groups, all hashes are in one stripe,
+    // so concurrent insertions are serialized.
+    
+    void reserve(size_t count) {
+      size_t capacity = _capacity;
+      while ((_used + count) * 8 > capacity * 7) {
+        capacity *= 2;
+      }
+      if (capacity != _capacity) {
+        rehash(capacity);
+      }
+    }
+    
+    inline size_t stripe(size_t hash) const { return 0; }
+    
+    void insert_concurrent(Node* node) {
+      assert(!node->is_in_hashcons());
+      place(node, node->hash());
+    }
+    
+    void end_concurrent(size_t count) {
+      _count += count;
+    }
+  };
+  
+  // Fixed set of worker threads for running parallel loops.
+  // The calling thread participates in every loop as thread 0.
+  class ThreadPool {
+  private:
+    std::vector<std::thread> _threads;
+    
+    std::mutex _mutex;
+    std::condition_variable _start;
+    std::condition_variable _done;
+    std::function<void(size_t)> _job;
+    size_t _generation = 0;
+    size_t _running = 0;
+    bool _stop = false;
+    
+    void work(size_t thread) {
+      size_t generation = 0;
+      while (true) {
+        {
+          std::unique_lock<std::mutex> lock(_mutex);
+          _start.wait(lock, [&](){ return _stop || _generation != generation; });
+          if (_stop) {
+            return;
+          }
+          generation = _generation;
+        }
+        
+        _job(thread);
+        
+        {
+          std::unique_lock<std::mutex> lock(_mutex);
+          _running--;
+          if (_running == 0) {
+            _done.notify_all();
+          }
+        }
+      }
+    }
+  public:
+    explicit ThreadPool(size_t thread_count = std::thread::hardware_concurrency()) {
+      for (size_t it = 1; it < thread_count; it++) {
+        _threads.emplace_back([this, it](){ work(it); });
+      }
+    }
+    
+    owned(ThreadPool)
+    
+    ~ThreadPool() {
+      {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _stop = true;
+      }
+      _start.notify_all();
+      for (std::thread& thread : _threads) {
+        thread.join();
+      }
+    }
+    
+    // Number of threads including the calling thread
+    inline size_t size() const { return _threads.size() + 1; }
+    
+    // Calls fn(index, thread) for every index in [0, count) and waits
+    // until all calls returned. Indices are distributed dynamically.
+    // The thread index is in [0, size()), so it may be used to select
+    // per-thread state. fn must not throw.
+    template <class Fn>
+    void parallel_for(size_t count, const Fn& fn) {
+      std::atomic<size_t> next(0);
+      auto job = [&](size_t thread){
+        while (true) {
+          size_t index = next.fetch_add(1, std::memory_order_relaxed);
+          if (index >= count) {
+            break;
+          }
+          fn(index, thread);
+        }
+      };
+      
+      if (_threads.empty() || count <= 1) {
+        job(0);
+        return;
+      }
+      
+      {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _job = job;
+        _running = _threads.size();
+        _generation++;
+      }
+      _start.notify_all();
+      
+      job(0);
+      
+      std::unique_lock<std::mutex> lock(_mutex);
+      _done.wait(lock, [&](){ return _running == 0; });
+      _job = nullptr;
+    }
+  };
+  
+  // Reason why Runner::run stopped
+  enum class StopReason {
+    Saturated,
+    IterationLimit,
+    NodeLimit,
+    MemoryLimit,
+    TimeLimit
+  };
+  
+  inline std::ostream& operator<<(std::ostream& stream, StopReason reason) {
+    static const char* NAMES[] = {
+      "Saturated", "IterationLimit", "NodeLimit", "MemoryLimit", "TimeLimit"
+    };
+    stream << NAMES[size_t(reason)];
+    return stream;
+  }
+  
+  // Rule schedulers decide which rules are searched and applied in
+  // each iteration of equality saturation. Rules are identified by
+  // their index in the rule set.
+  
+  // Searches and applies all rules in every iteration
+  class SimpleScheduler {
+  public:
+    SimpleScheduler() {}
+    
+    bool can_search(size_t iteration, size_t rule) { return true; }
+    bool can_apply(size_t iteration, size_t rule, size_t match_count) { return true; }
+    bool can_stop(size_t iteration) { return true; }
+  };
+  
+  // Bans rules which produce too many matches for a number of
+  // iterations. Every time a rule is banned, its match limit and its
+  // ban length are doubled. This prevents explosive rules like
+  // associativity from starving other rules.
+  // See: egg's BackoffScheduler
+  class BackoffScheduler {
+  private:
+    struct RuleStats {
+      size_t times_banned = 0;
+      size_t banned_until = 0;
+    };
+    
+    size_t _match_limit = 1000;
+    size_t _ban_length = 5;
+    std::vector<RuleStats> _stats;
+    
+    RuleStats& stats(size_t rule) {
+      if (rule >= _stats.size()) {
+        _stats.resize(rule + 1);
+      }
+      return _stats[rule];
+    }
+    
+    // value << shift, saturating at SIZE_MAX
+    static size_t saturating_shift(size_t value, size_t shift) {
+      if (shift >= sizeof(size_t) * 8 || value > (SIZE_MAX >> shift)) {
+        return SIZE_MAX;
+      }
+      return value << shift;
+    }
+    
+    static size_t saturating_add(size_t a, size_t b) {
+      size_t sum = 0;
+      if (__builtin_add_overflow(a, b, &sum)) {
+        return SIZE_MAX;
+      }
+      return sum;
+    }
+  public:
+    BackoffScheduler() {}
+    BackoffScheduler(size_t match_limit, size_t ban_length):
+      _match_limit(match_limit), _ban_length(ban_length) {}
+    
+    size_t times_banned(size_t rule) { return stats(rule).times_banned; }
+    bool is_banned(size_t iteration, size_t rule) { return stats(rule).banned_until > iteration; }
+    
+    bool can_search(size_t iteration, size_t rule) {
+      return !is_banned(iteration, rule);
+    }
+    
+    // Returns false and bans the rule if it exceeds its match limit
+    bool can_apply(size_t iteration, size_t rule, size_t match_count) {
+      RuleStats& rule_stats = stats(rule);
+      size_t shift = rule_stats.times_banned;
+      if (match_count <= saturating_shift(_match_limit, shift)) {
+        return true;
+      }
+      rule_stats.banned_until = saturating_add(iteration, saturating_shift(_ban_length, shift));
+      rule_stats.times_banned++;
+      return false;
+    }
+    
+    // The e-graph is only saturated if no rule was banned in the given
+    // iteration. Otherwise all bans are lifted and saturation continues
+    // in the next iteration.
+    bool can_stop(size_t iteration) {
+      bool any_banned = false;
+      for (RuleStats& rule_stats : _stats) {
+        if (rule_stats.banned_until > iteration) {
+          rule_stats.banned_until = iteration + 1;
+          any_banned = true;
+        }
+      }
+      return !any_banned;
+    }
+  };
+  
+  // E-class analyses attach data to every equivalence class which is
+  // maintained automatically. An analysis provides:
+  //   Data: Type of the data attached to a class. Must be default
+  //     constructible.
+  //   Data make(EGraph& e_graph, Node* node): Data of a new node.
+  //     The data of its children's classes is available using
+  //     e_graph.analysis(child).
+  //   bool join(Data& a, const Data& b): Joins b into a. Returns true
+  //     if a changed.
+  //   void modify(EGraph& e_graph, Node* root, MergeQueue& queue):
+  //     Called after the data of a class was created or changed. May
+  //     add nodes and queue merges, which are executed by the next call
+  //     to merge or rebuild.
+  // Since the EGraph type depends on the analysis, make and modify are
+  // usually templates.
+  
+  // Analysis which does not store any data
+  struct NoAnalysis {
+    struct Data {};
+    
+    template <class EGraph>
+    Data make(EGraph& e_graph, typename EGraph::Node* node) { return Data(); }
+    
+    bool join(Data& a, const Data& b) { return false; }
+    
+    template <class EGraph>
+    void modify(EGraph& e_graph, typename EGraph::Node* root, typename EGraph::MergeQueue& queue) {}
+  };
+  
+  template <class NodeKind,
+            class NodeData = SimpleNodeData<NodeKind>,
+            template <class> class Hashcons = ChainedHashcons,
+            class Hasher = NodeHasher,
+            class Analysis = NoAnalysis>
   class EGraph {
   public:
     struct Node;
+    class MergeQueue;
   private:
     template <class T>
     struct CycleRange {
@@ -150,23 +885,19 @@ namespace egraphs {
       bool empty() const { return first == nullptr; }
     };
     
+    // The uses of a node's children are allocated directly in front of
+    // the node: [Use n-1] ... [Use 1] [Use 0] [Node]
+    // This allows computing the user from the use without storing it.
     struct Use {
-      Node* node = nullptr;
-      size_t child_index = 0;
       Use* next = nullptr;
+      uint32_t child_index = 0;
       
-      Use(Node* _node, size_t _child_index):
-          node(_node), child_index(_child_index) {
+      Use(uint32_t _child_index): child_index(_child_index) {
         next = this;
       }
-    };
-    
-    struct Down {
-      Node* node = nullptr;
-      Down* next = nullptr;
       
-      Down(Node* _node): node(_node) {
-        next = this;
+      inline Node* node() const {
+        return (Node*)(this + child_index + 1);
       }
     };
     
@@ -181,38 +912,43 @@ namespace egraphs {
         using pointer = Node**;
         using reference = Node*&;
       private:
-        Down* _initial = nullptr;
-        Down* _current = nullptr;
+        Node* _initial = nullptr;
+        Node* _current = nullptr;
+        // Unlink nodes which are not in the hashcons from the class
+        bool _splice = true;
       
         void next() {
           assert(_current != nullptr);
-          if (_current->next == _initial) {
+          if (_current->_next_in_class == _initial) {
             _current = nullptr;
           } else {
-            _current = _current->next;
+            _current = _current->_next_in_class;
           }
         }
       
         void skip_to_next_in_hashcons() {
-          while (_current != nullptr && !_current->node->is_in_hashcons()) {
+          while (_current != nullptr && !_current->is_in_hashcons()) {
             next();
           }
         }
       public:
-        explicit Iterator(Down* initial, Down* current):
-            _initial(initial), _current(current) {
+        explicit Iterator(Node* initial, Node* current, bool splice = true):
+            _initial(initial), _current(current), _splice(splice) {
           skip_to_next_in_hashcons();
         }
         
         Iterator& operator++() {
           if (_current != nullptr) {
-            Down* prev = _current;
+            Node* prev = _current;
             next();
             skip_to_next_in_hashcons();
+            if (!_splice) {
+              return *this;
+            }
             if (_current == nullptr) {
-              prev->next = _initial;
+              prev->_next_in_class = _initial;
             } else {
-              prev->next = _current;
+              prev->_next_in_class = _current;
             }
           }
           return *this;
@@ -230,7 +966,7 @@ namespace egraphs {
         }
         
         bool operator!=(const Iterator& other) const { return !(*this == other); }
-        Node* operator*() const { return _current->node; }
+        Node* operator*() const { return _current; }
       
         bool at_end() const { return _current == nullptr; }
       };
@@ -307,11 +1043,19 @@ namespace egraphs {
       private:
         EClass _e_class;
         Matcher _matcher;
+        // False if the kind summary of the class rules out any match
+        bool _may_match = true;
       public:
-        MatchRange(const EClass& e_class, const Matcher& matcher):
-          _e_class(e_class), _matcher(matcher) {}
+        MatchRange(const EClass& e_class, const Matcher& matcher, bool may_match = true):
+          _e_class(e_class), _matcher(matcher), _may_match(may_match) {}
+        
+        MatchIterator<Matcher> begin() {
+          if (!_may_match) {
+            return end();
+          }
+          return MatchIterator<Matcher>(_e_class.begin(), _matcher);
+        }
         
-        MatchIterator<Matcher> begin() { return MatchIterator<Matcher>(_e_class.begin(), _matcher); }
         MatchIterator<Matcher> end() { return MatchIterator<Matcher>(_e_class.end(), _matcher); }
         
         bool empty() { return begin() == end(); }
@@ -324,54 +1068,121 @@ namespace egraphs {
       
       const Node* root() const { return _root; }
       
-      Iterator begin() { return Iterator(_root->_down, _root->_down); }
-      Iterator end() { return Iterator(_root->_down, nullptr); }
+      Iterator begin() { return Iterator(_root, _root); }
+      Iterator end() { return Iterator(_root, nullptr); }
+      
+      // Iterating over an equivalence class using begin/end unlinks
+      // nodes which were evicted from the hashcons. The read only range
+      // skips them instead, so multiple threads may iterate at once.
+      class ReadOnlyRange {
+      private:
+        Node* _root = nullptr;
+      public:
+        explicit ReadOnlyRange(Node* root): _root(root) {}
+        
+        Iterator begin() const { return Iterator(_root, _root, false); }
+        Iterator end() const { return Iterator(_root, nullptr, false); }
+      };
+      
+      ReadOnlyRange read_only() const { return ReadOnlyRange(_root); }
       
       template <class Matcher>
       MatchRange<Matcher> match(const Matcher& matcher) { return MatchRange<Matcher>(*this, matcher); }
-      MatchRange<NodeDataMatcher> match(const NodeData& data) { return match(NodeDataMatcher(data)); }
-      MatchRange<NodeKindMatcher> match(const NodeKind& kind) { return match(NodeKindMatcher(kind)); }
       
-    };
+      MatchRange<NodeDataMatcher> match(const NodeData& data) {
+        return MatchRange<NodeDataMatcher>(*this, NodeDataMatcher(data), may_contain(data.kind()));
+      }
+      
+      MatchRange<NodeKindMatcher> match(const NodeKind& kind) {
+        return MatchRange<NodeKindMatcher>(*this, NodeKindMatcher(kind), may_contain(kind));
+      }
+      
+      // Returns false if the class contains no node of the given kind.
+      // May return true even if there is no such node.
+      bool may_contain(const NodeKind& kind) const {
+        return (_root->_kind_mask & Node::kind_bit(kind)) != 0;
+      }
+      
+    };
     
     class Node {
     private:
-      friend EGraph<NodeKind, NodeData>;
+      friend EGraph;
+      friend Hashcons<Node>;
       
       NodeData _data;
       
+      // Index of the node in creation order
+      uint32_t _id = 0;
+      uint32_t _child_count = 0;
+      
       // Union Find
-      size_t _rank = 0;
+      uint8_t _rank = 0;
+      
+      // Node is queued for re-canonicalization by rebuild
+      bool _pending = false;
+      
+      // Root node is queued for analysis propagation
+      bool _analysis_pending = false;
+      
       Node* _up = nullptr;
       
+      // If this node is a root node, kind_mask summarizes the kinds of
+      // all nodes in its equivalence class. Each kind is hashed to one
+      // of 64 bits. Bits are never cleared, so the mask may contain
+      // kinds of nodes which were evicted from the hashcons.
+      uint64_t _kind_mask = 0;
+      
+      // Epoch in which the node was created. If this node is a root
+      // node, this is the latest epoch in which its equivalence class
+      // changed (see EGraph::epoch).
+      uint64_t _timestamp = 0;
+      
       // If this node is a root node, uses contains a cyclic linked
-      // list of all users of the node and down contains a cyclic
-      // linked list of all nodes in the equivalence class.
+      // list of all users of the node.
       Use* _uses = nullptr;
-      Down* _down;
+      
+      // Cyclic linked list of all nodes in the equivalence class.
+      // Iterating over an equivalence class starts at its root node.
+      Node* _next_in_class = nullptr;
       
       // Hashcons
-      Node* _next_bucket = nullptr;
-      Node** _prev_bucket = nullptr;
+      typename Hashcons<Node>::Link _hashcons_link;
+      
+      // Combined hash of the node data and all children before
+      // Hasher::finish is applied. Since the hashes of the children
+      // are combined using XOR, a single child can be replaced in O(1).
+      size_t _partial_hash = 0;
       
       // The children of the node are stored in a flexible array member
       // directly after this structure.
-      size_t _child_count = 0;
       Node* _children[];
       
       Node(const NodeData& data,
-           Down* down,
-           size_t child_count,
+           uint32_t id,
+           size_t partial_hash,
+           uint32_t child_count,
            Node** children):
           _data(data),
-          _down(down),
-          _child_count(child_count) {
+          _id(id),
+          _child_count(child_count),
+          _kind_mask(kind_bit(data.kind())),
+          _next_in_class(this),
+          _partial_hash(partial_hash) {
         
         std::copy(children, children + child_count, _children);
       }
       
+      inline Use* use(size_t index) {
+        return (Use*)this - index - 1;
+      }
+      
+      static inline uint64_t kind_bit(const NodeKind& kind) {
+        return uint64_t(1) << (std::hash<NodeKind>()(kind) & 63);
+      }
+      
       bool is_in_hashcons() const {
-        return _prev_bucket != nullptr;
+        return _hashcons_link.is_linked();
       }
       
       void insert_uses(Use* uses) {
@@ -394,14 +1205,19 @@ namespace egraphs {
         assert(other->_up == nullptr);
         
         _up = other;
-        if (_rank == other->_rank) {
+        if (_rank == other->_rank && other->_rank < UINT8_MAX) {
           other->_rank++;
         }
         
-        Down* temp = other->_down->next;
-        other->_down->next = _down->next;
-        _down->next = temp;
-        _down = nullptr;
+        return absorb(other);
+      }
+      
+      // Moves the nodes, kinds and uses of the equivalence class of this
+      // node to other. This node must have been linked below other in
+      // the union find.
+      CycleRange<Use> absorb(Node* other) {
+        std::swap(_next_in_class, other->_next_in_class);
+        other->_kind_mask |= _kind_mask;
         
         if (_uses != nullptr) {
           CycleRange<Use> range(_uses->next, _uses);
@@ -416,17 +1232,35 @@ namespace egraphs {
       // In order to find nodes in the hashcons, we need to hash
       // and compare nodes.
       
-      static size_t hash(const NodeData& data, Node** children, size_t child_count) {
-        size_t hash = std::hash<NodeData>()(data);
-        hash ^= std::hash<size_t>()(child_count) << 17;
+      static size_t partial_hash(const NodeData& data, Node** children, size_t child_count) {
+        size_t hash = Hasher::data(data, child_count);
         for (size_t it = 0; it < child_count; it++) {
-          hash ^= std::hash<Node*>()(children[it]);
+          hash ^= Hasher::child(children[it], it);
         }
         return hash;
       }
       
       size_t hash() const {
-        return hash(_data, (Node**)_children, _child_count);
+        return Hasher::finish(_partial_hash);
+      }
+      
+      // Replaces a child and incrementally updates the cached hash
+      void replace_child(size_t index, Node* child) {
+        assert(index < _child_count);
+        _partial_hash ^= Hasher::child(_children[index], index);
+        _partial_hash ^= Hasher::child(child, index);
+        _children[index] = child;
+        assert(_partial_hash == partial_hash(_data, _children, _child_count));
+      }
+      
+      // A node is canonical if all of its children are root nodes
+      bool is_canonical() const {
+        for (size_t it = 0; it < _child_count; it++) {
+          if (_children[it]->_up != nullptr) {
+            return false;
+          }
+        }
+        return true;
       }
       
       bool eq(const NodeData& data, Node** children, size_t child_count) const {
@@ -446,6 +1280,7 @@ namespace egraphs {
     public:
       
       const NodeData& data() const { return _data; }
+      uint32_t id() const { return _id; }
       
       EClass e_class() { return EClass(this); }
       
@@ -462,6 +1297,16 @@ namespace egraphs {
       
       inline Node* operator[](size_t index) { return at(index); }
       
+      // Finds the root node without path compression. Unlike root, this
+      // does not modify the union find.
+      Node* find() const {
+        Node* root = const_cast<Node*>(this);
+        while (root->_up != nullptr) {
+          root = root->_up;
+        }
+        return root;
+      }
+      
       // Finds the root node in the union find.
       // Performs path compression.
       Node* root() {
@@ -480,77 +1325,401 @@ namespace egraphs {
     };
     
   private:
-    class Hashcons {
-    private:
-      Node** _data = nullptr;
-      size_t _size = 0;
-    public:
-      Hashcons() {
-        _size = 1024;
-        _data = new Node*[_size]();
+    Hashcons<Node> _hashcons;
+    std::unordered_set<Node*> _roots;
+    
+    ArenaAllocator _node_allocator;
+    size_t _node_count = 0;
+    
+    // Struct of arrays indexed by node id.
+    // Scans stream through these arrays and only access the nodes
+    // they actually visit.
+    std::vector<Node*> _nodes;
+    std::vector<NodeKind> _kinds;
+    
+    // Nodes grouped by kind.
+    // Contains nodes which were removed from the hashcons, since merging
+    // evicted them as congruent duplicates. These are removed in bulk
+    // once they make up a large enough fraction of the index.
+    std::unordered_map<NodeKind, std::vector<Node*>> _kind_index;
+    size_t _evicted = 0;
+    // Number of live NodeLists. Compaction is deferred while any of them
+    // refers into the index.
+    mutable size_t _node_list_count = 0;
+    
+    void compact_kind_index() {
+      if (_node_list_count > 0 || _evicted * 4 <= _hashcons.size()) {
+        return;
       }
-      
-      owned(Hashcons)
-      
-      ~Hashcons() {
-        delete[] _data;
+      for (auto& [kind, nodes] : _kind_index) {
+        nodes.erase(std::remove_if(nodes.begin(), nodes.end(), [](Node* node){
+          return !node->is_in_hashcons();
+        }), nodes.end());
       }
-      
-      Node* get(const NodeData& data, Node** children, size_t child_count) {
-        size_t hash = Node::hash(data, children, child_count) % _size;
-        Node* node = _data[hash];
-        while (node != nullptr) {
-          if (node->eq(data, children, child_count)) {
-            return node;
-          }
-          node = node->_next_bucket;
+      _evicted = 0;
+    }
+    
+    // Users which need to be re-canonicalized by rebuild
+    std::vector<Node*> _pending;
+    
+    void mark_pending(const CycleRange<Use>& uses) {
+      for_each_user(uses, [&](Node* user, size_t child_index){
+        if (!user->_pending) {
+          user->_pending = true;
+          _pending.push_back(user);
         }
-        return nullptr;
+      });
+    }
+    
+    // State of the concurrent phase (see begin_concurrent)
+    static constexpr const size_t LOCK_COUNT = 256;
+    
+    struct alignas(64) ConcurrentThread {
+      // Nodes created by the thread which are not registered yet
+      std::vector<Node*> nodes;
+      // Roots which the thread linked below another root
+      std::vector<Node*> linked;
+    };
+    
+    std::unique_ptr<std::mutex[]> _locks;
+    std::vector<ConcurrentThread> _concurrent_threads;
+    size_t _concurrent_limit = 0;
+    std::atomic<size_t> _concurrent_count = 0;
+    std::atomic<bool> _concurrent_overflow = false;
+    
+    // Each thread allocates from its own arena, which is created by its
+    // first allocation and kept for later concurrent phases.
+    std::vector<std::unique_ptr<ArenaAllocator>> _thread_allocators;
+    
+    // Allocates a node and the uses of its children in front of it
+    static Node* alloc_node(ArenaAllocator& allocator,
+                            const NodeData& data,
+                            size_t partial_hash,
+                            Node** children,
+                            size_t child_count) {
+      // Use records are placed directly before the node. The prefix is
+      // padded so that the node itself stays aligned.
+      size_t prefix = sizeof(Use) * child_count;
+      prefix = (prefix + alignof(Node) - 1) / alignof(Node) * alignof(Node);
+      uint8_t* memory = (uint8_t*)allocator.alloc(
+        prefix + sizeof(Node) + sizeof(Node*) * child_count,
+        alignof(Node)
+      );
+      Node* node = (Node*)(memory + prefix);
+      new(node) Node(data, 0, partial_hash, uint32_t(child_count), children);
+      for (size_t it = 0; it < child_count; it++) {
+        new(node->use(it)) Use(uint32_t(it));
       }
-      
-      Node* get(Node* node) {
-        return get(node->_data, node->_children, node->_child_count);
+      return node;
+    }
+    
+    // Assigns an id to a new node which was inserted into the hashcons
+    // and registers it with its children and all indices.
+    void register_node(Node* node) {
+      node->_id = uint32_t(_node_count++);
+      for (size_t it = 0; it < node->_child_count; it++) {
+        node->_children[it]->insert_uses(node->use(it));
       }
       
-      // Removes a node from the hashcons.
-      // Assumes that the node is currently in the hashcons.
-      void erase(Node* node) {
-        assert(node->is_in_hashcons());
-        
-        *node->_prev_bucket = node->_next_bucket;
-        if (node->_next_bucket != nullptr) {
-          node->_next_bucket->_prev_bucket = node->_prev_bucket;
+      _roots.insert(node);
+      _nodes.push_back(node);
+      _kinds.push_back(node->_data.kind());
+      _kind_index[node->_data.kind()].push_back(node);
+      record_change(node);
+      if constexpr (HAS_ANALYSIS) {
+        _analysis_data.emplace_back();
+      }
+    }
+    
+    // Analysis
+    static constexpr const bool HAS_ANALYSIS = !std::is_same_v<Analysis, NoAnalysis>;
+    
+    Analysis _analysis;
+    
+    // Wrapper which avoids std::vector<bool>
+    struct AnalysisData {
+      typename Analysis::Data data;
+    };
+    
+    // Indexed by node id. Only the entries of root nodes are valid.
+    std::vector<AnalysisData> _analysis_data;
+    // Roots whose data changed, so the data of their users' classes
+    // needs to be updated
+    std::vector<Node*> _analysis_pending;
+    
+    void queue_analysis(Node* root) {
+      if (!root->_analysis_pending) {
+        root->_analysis_pending = true;
+        _analysis_pending.push_back(root);
+      }
+    }
+    
+    // Joins the data of the absorbed class into its new root
+    void join_analysis(Node* root, Node* child) {
+      if constexpr (HAS_ANALYSIS) {
+        typename Analysis::Data& root_data = _analysis_data[root->_id].data;
+        typename Analysis::Data& child_data = _analysis_data[child->_id].data;
+        // The entry of the child is no longer used, so the joined data
+        // is computed in place to check whether it changed for users
+        // of either class.
+        bool child_changed = _analysis.join(child_data, root_data);
+        bool root_changed = _analysis.join(root_data, child_data);
+        if (child_changed || root_changed) {
+          queue_analysis(root);
         }
-        node->_next_bucket = nullptr;
-        node->_prev_bucket = nullptr;
       }
-      
-      // Assumes that node is not currently in the hashcons.
-      void insert(Node* node) {
-        assert(!node->is_in_hashcons());
+    }
+    
+    // Computes the data of a new node and calls modify on its class
+    void make_analysis(Node* node) {
+      if constexpr (HAS_ANALYSIS) {
+        _analysis_data[node->_id].data = _analysis.make(*this, node);
+        _analysis.modify(*this, node, _analysis_queue);
+      }
+    }
+    
+    // Calls modify on all classes whose data changed and propagates the
+    // changes to the classes of their users. Merges requested by modify
+    // are moved to the queue. Returns true if the queue is not empty.
+    bool analyze(MergeQueue& queue) {
+      if constexpr (HAS_ANALYSIS) {
+        while (!_analysis_pending.empty()) {
+          Node* node = _analysis_pending.back();
+          _analysis_pending.pop_back();
+          node->_analysis_pending = false;
+          
+          Node* root = node->root();
+          _analysis.modify(*this, root, _analysis_queue);
+          for_each_user_of(root, [&](Node* user){
+            Node* user_root = user->root();
+            typename Analysis::Data data = _analysis.make(*this, user);
+            if (_analysis.join(_analysis_data[user_root->_id].data, data)) {
+              queue_analysis(user_root);
+            }
+          });
+        }
         
-        size_t hash = node->hash() % _size;
-        node->_next_bucket = _data[hash];
-        if (_data[hash] != nullptr) {
-          _data[hash]->_prev_bucket = &node->_next_bucket;
+        while (!_analysis_queue.empty()) {
+          auto [a, b] = _analysis_queue.pop();
+          queue.merge(a, b);
         }
-        _data[hash] = node;
-        node->_prev_bucket = &_data[hash];
       }
-    };
+      return !queue.empty();
+    }
     
-    Hashcons _hashcons;
-    std::unordered_set<Node*> _roots;
+    // Log of all changes to the e-graph. Contains the new node for
+    // each created node and the new root for each union.
+    std::vector<Node*> _changes;
     
-    ArenaAllocator _node_allocator;
-    ArenaAllocator _down_allocator;
-    ArenaAllocator _use_allocator;
+    void record_change(Node* node) {
+      _changes.push_back(node);
+      node->_timestamp = _changes.size();
+    }
+    
+    // Unites the equivalence classes of two distinct root nodes.
+    // Returns the new root and the uses of the absorbed root.
+    std::pair<Node*, CycleRange<Use>> union_roots(Node* a, Node* b) {
+      Node* root = b;
+      Node* child = a;
+      if (root->_rank < child->_rank) {
+        std::swap(root, child);
+      }
+      
+      CycleRange<Use> uses = child->merge_roots(root);
+      _roots.erase(child);
+      record_change(root);
+      join_analysis(root, child);
+      return {root, uses};
+    }
+    
+    // Calls fn(user) for every user of a root node which is in the
+    // hashcons. Does not modify the uses.
+    template <class Fn>
+    void for_each_user_of(Node* root, const Fn& fn) {
+      if (root->_uses == nullptr) {
+        return;
+      }
+      Use* use = root->_uses;
+      do {
+        Node* user = use->node();
+        if (user->is_in_hashcons()) {
+          fn(user);
+        }
+        use = use->next;
+      } while (use != root->_uses);
+    }
+    
+    // Calls fn(user, child_index) for every use in the range whose user
+    // is still in the hashcons. Uses of other nodes are unlinked.
+    template <class Fn>
+    void for_each_user(const CycleRange<Use>& uses, const Fn& fn) {
+      if (uses.empty()) {
+        return;
+      }
+      
+      Use* use = uses.first;
+      Use* prev = nullptr;
+      while (true) {
+        Node* user = use->node();
+        if (user->is_in_hashcons()) {
+          fn(user, use->child_index);
+          
+          if (prev != nullptr) {
+            prev->next = use;
+          }
+          prev = use;
+        }
+        
+        if (use == uses.last) {
+          break;
+        }
+        use = use->next;
+      }
+    }
   public:
     EGraph() {}
+    explicit EGraph(const Analysis& analysis): _analysis(analysis) {}
     owned(EGraph)
     
     const std::unordered_set<Node*>& roots() const { return _roots; }
     
+    // Number of nodes created so far.
+    // Node ids are in the range [0, node_count()).
+    inline size_t node_count() const { return _node_count; }
+    // Bytes allocated for nodes and their uses
+    size_t memory_usage() const {
+      size_t size = _node_allocator.size();
+      for (const std::unique_ptr<ArenaAllocator>& allocator : _thread_allocators) {
+        if (allocator) {
+          size += allocator->size();
+        }
+      }
+      return size;
+    }
+    inline Node* node_by_id(uint32_t id) const { return _nodes.at(id); }
+    
+    // Calls fn(node) for every node in the hashcons in order of creation.
+    // Nodes created by fn are not visited.
+    template <class Fn>
+    void scan(const Fn& fn) {
+      size_t count = _nodes.size();
+      for (size_t it = 0; it < count; it++) {
+        Node* node = _nodes[it];
+        if (node->is_in_hashcons()) {
+          fn(node);
+        }
+      }
+    }
+    
+    // Range over a list of nodes which skips nodes that are no longer
+    // in the hashcons. Nodes appended to the list after the range was
+    // created are not visited, so it is safe to create nodes while
+    // iterating. The kind index is not compacted while a NodeList is
+    // alive, so merging and rebuilding are safe as well.
+    // NodeLists must not outlive their EGraph.
+    class NodeList {
+    public:
+      class Iterator {
+      public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = Node*;
+        using difference_type = std::ptrdiff_t;
+        using pointer = Node**;
+        using reference = Node*&;
+      private:
+        const std::vector<Node*>* _nodes = nullptr;
+        size_t _index = 0;
+        size_t _end = 0;
+        
+        void skip_to_next_in_hashcons() {
+          while (_index < _end && !(*_nodes)[_index]->is_in_hashcons()) {
+            _index++;
+          }
+        }
+      public:
+        Iterator(const std::vector<Node*>* nodes, size_t index, size_t end):
+            _nodes(nodes), _index(index), _end(end) {
+          skip_to_next_in_hashcons();
+        }
+        
+        Iterator& operator++() {
+          _index++;
+          skip_to_next_in_hashcons();
+          return *this;
+        }
+        
+        bool operator==(const Iterator& other) const { return _index == other._index; }
+        bool operator!=(const Iterator& other) const { return !(*this == other); }
+        Node* operator*() const { return (*_nodes)[_index]; }
+      };
+    private:
+      const std::vector<Node*>* _nodes = nullptr;
+      size_t _size = 0;
+      size_t* _live = nullptr;
+      
+      void acquire() { if (_live) { (*_live)++; } }
+      void release() { if (_live) { (*_live)--; } }
+    public:
+      NodeList() {}
+      NodeList(const std::vector<Node*>* nodes, size_t* live):
+          _nodes(nodes), _size(nodes->size()), _live(live) {
+        acquire();
+      }
+      
+      NodeList(const NodeList& other):
+          _nodes(other._nodes), _size(other._size), _live(other._live) {
+        acquire();
+      }
+      
+      NodeList& operator=(const NodeList& other) {
+        if (this != &other) {
+          release();
+          _nodes = other._nodes;
+          _size = other._size;
+          _live = other._live;
+          acquire();
+        }
+        return *this;
+      }
+      
+      ~NodeList() { release(); }
+      
+      Iterator begin() const { return Iterator(_nodes, 0, _size); }
+      Iterator end() const { return Iterator(_nodes, _size, _size); }
+      
+      bool empty() const { return begin() == end(); }
+      
+      // Entries of the list, including nodes which are no longer in the
+      // hashcons. Allows partitioning the list.
+      size_t size() const { return _size; }
+      Node* at(size_t index) const { return (*_nodes)[index]; }
+    };
+    
+    // All nodes of the given kind which are in the hashcons
+    NodeList nodes_of_kind(const NodeKind& kind) const {
+      auto it = _kind_index.find(kind);
+      if (it == _kind_index.end()) {
+        return NodeList();
+      }
+      return NodeList(&it->second, &_node_list_count);
+    }
+    
+    // Calls fn(node) for every node of the given kind in the hashcons.
+    // Only the dense array of node kinds is read for other nodes.
+    template <class Fn>
+    void scan(const NodeKind& kind, const Fn& fn) {
+      size_t count = _kinds.size();
+      for (size_t it = 0; it < count; it++) {
+        if (_kinds[it] == kind) {
+          Node* node = _nodes[it];
+          if (node->is_in_hashcons()) {
+            fn(node);
+          }
+        }
+      }
+    }
+    const Hashcons<Node>& hashcons() const { return _hashcons; }
+    
     Node* node(const NodeData& data, Node** children, size_t child_count) {
       // All children must be root nodes
       for (size_t it = 0; it < child_count; it++) {
@@ -558,27 +1727,20 @@ namespace egraphs {
       }
       
       // Check if node is already in hashcons
-      Node* node = _hashcons.get(data, children, child_count);
+      size_t partial_hash = Node::partial_hash(data, children, child_count);
+      Node* node = _hashcons.get(Hasher::finish(partial_hash), data, children, child_count);
       if (node != nullptr) {
         return node->root();
       }
       
       // Node is not in hashcons -> allocate new node
-      node = (Node*)_node_allocator.alloc(sizeof(Node) + sizeof(Node*) * child_count, alignof(Node));
-      Down* down = _down_allocator.alloc<Down>();
-      new(down) Down(node);
-      new(node) Node(data, down, child_count, children);
-      
-      for (size_t it = 0; it < child_count; it++) {
-        Use* use = _use_allocator.alloc<Use>();
-        new(use) Use(node, it);
-        children[it]->insert_uses(use);
+      if (_node_count >= UINT32_MAX) {
+        throw_error(Error, "More than " << UINT32_MAX << " nodes created");
       }
-      
-      // Insert into hashcons
+      node = alloc_node(_node_allocator, data, partial_hash, children, child_count);
       _hashcons.insert(node);
-      _roots.insert(node);
-      
+      register_node(node);
+      make_analysis(node);
       return node;
     }
     
@@ -590,6 +1752,120 @@ namespace egraphs {
       return node(data, nullptr, 0);
     }
     
+    // Concurrent node creation
+    // Between begin_concurrent and end_concurrent, multiple threads may
+    // create nodes using concurrent_node. Each thread passes a distinct
+    // index below thread_count. The hashcons is locked in stripes and
+    // resized up front to fit max_nodes new nodes, so threads only wait
+    // for each other when inserting into the same stripe. SwissHashcons
+    // has a single stripe, so with it insertions are serialized. New
+    // nodes are allocated from per-thread arenas and only registered
+    // (ids, uses, roots and kind index) by end_concurrent.
+    // No other operation may modify the e-graph during this phase.
+    
+    void begin_concurrent(size_t thread_count, size_t max_nodes) {
+      assert(_concurrent_threads.empty());
+      _hashcons.reserve(max_nodes);
+      _locks.reset(new std::mutex[LOCK_COUNT]);
+      _concurrent_threads.resize(thread_count);
+      // Node ids must fit into 32 bits
+      _concurrent_limit = std::min(max_nodes, size_t(UINT32_MAX) - _node_count);
+      _concurrent_count = 0;
+      _concurrent_overflow = false;
+      if (_thread_allocators.size() < thread_count) {
+        _thread_allocators.resize(thread_count);
+      }
+    }
+    
+    // Like node, but may be called by multiple threads at once.
+    // All children must be root nodes. Returns nullptr if the node does
+    // not exist yet and max_nodes nodes were already created in this
+    // phase. end_concurrent then reports the overflow.
+    Node* concurrent_node(size_t thread, const NodeData& data, Node** children, size_t child_count) {
+      assert(_locks && thread < _concurrent_threads.size());
+      for (size_t it = 0; it < child_count; it++) {
+        assert(children[it]->_up == nullptr);
+      }
+      
+      size_t partial_hash = Node::partial_hash(data, children, child_count);
+      size_t hash = Hasher::finish(partial_hash);
+      
+      std::lock_guard<std::mutex> lock(_locks[_hashcons.stripe(hash) % LOCK_COUNT]);
+      Node* node = _hashcons.get(hash, data, children, child_count);
+      if (node != nullptr) {
+        return node->find();
+      }
+      
+      if (_concurrent_count.fetch_add(1, std::memory_order_relaxed) >= _concurrent_limit) {
+        _concurrent_overflow.store(true, std::memory_order_relaxed);
+        return nullptr;
+      }
+      
+      std::unique_ptr<ArenaAllocator>& allocator = _thread_allocators[thread];
+      if (!allocator) {
+        allocator.reset(new ArenaAllocator());
+      }
+      node = alloc_node(*allocator, data, partial_hash, children, child_count);
+      _hashcons.insert_concurrent(node);
+      _concurrent_threads[thread].nodes.push_back(node);
+      return node;
+    }
+    
+    Node* concurrent_node(size_t thread, const NodeData& data, const std::vector<Node*>& children) {
+      return concurrent_node(thread, data, (Node**)(children.size() > 0 ? &children[0] : nullptr), children.size());
+    }
+    
+    Node* concurrent_node(size_t thread, const NodeData& data) {
+      return concurrent_node(thread, data, nullptr, 0);
+    }
+    
+    // Registers all nodes created since begin_concurrent. Node ids are
+    // assigned in order of the creating thread's index.
+    // Throws if any thread exceeded max_nodes, after registering the
+    // nodes which were created.
+    void end_concurrent() {
+      assert(_locks);
+      size_t first_id = _node_count;
+      size_t count = 0;
+      for (ConcurrentThread& thread : _concurrent_threads) {
+        for (Node* node : thread.nodes) {
+          register_node(node);
+        }
+        count += thread.nodes.size();
+      }
+      _hashcons.end_concurrent(count);
+      
+      _concurrent_threads.clear();
+      _locks.reset();
+      
+      if constexpr (HAS_ANALYSIS) {
+        // Children may have been created by threads with a higher index,
+        // so the analysis data of the new nodes is computed in
+        // topological order.
+        std::vector<bool> done(count, false);
+        std::vector<std::pair<Node*, size_t>> stack;
+        for (size_t it = 0; it < count; it++) {
+          stack.emplace_back(_nodes[first_id + it], 0);
+          while (!stack.empty()) {
+            auto& [node, child] = stack.back();
+            if (node->_id < first_id || done[node->_id - first_id]) {
+              stack.pop_back();
+            } else if (child < node->_child_count) {
+              stack.emplace_back(node->_children[child++], 0);
+            } else {
+              done[node->_id - first_id] = true;
+              make_analysis(node);
+              stack.pop_back();
+            }
+          }
+        }
+      }
+      
+      if (_concurrent_overflow) {
+        throw_error(Error, "More than " << _concurrent_limit << " nodes created in concurrent phase");
+      }
+    }
+    
     // Queue for storing merge operations before they are executed.
     // Will ignore already merged pairs.
     class MergeQueue {
@@ -618,6 +1894,17 @@ namespace egraphs {
       }
     };
     
+  private:
+    // Merges requested by Analysis::modify
+    MergeQueue _analysis_queue;
+  public:
+    Analysis& analysis() { return _analysis; }
+    
+    // Analysis data of the equivalence class of node
+    const typename Analysis::Data& analysis(Node* node) {
+      return _analysis_data[node->root()->_id].data;
+    }
+    
     void merge(Node* a, Node* b) {
       MergeQueue queue;
       queue.merge(a, b);
@@ -626,7 +1913,7 @@ namespace egraphs {
     
     bool merge(MergeQueue& queue) {
       bool changed = false;
-      while (!queue.empty()) {
+      while (!queue.empty() || analyze(queue)) {
         auto [a, b] = queue.pop();
         
         a = a->root();
@@ -635,198 +1922,2560 @@ namespace egraphs {
           continue;
         }
         
-        Node* root = b;
-        Node* child = a;
-        if (root->_rank < child->_rank) {
-          std::swap(root, child);
-        }
-        
-        CycleRange<Use> uses = child->merge_roots(root);
+        auto [root, uses] = union_roots(a, b);
         changed = true;
-        _roots.erase(child);
         
         // Update users
-        if (!uses.empty()) {
-          Use* use = uses.first;
-          Use* prev = nullptr;
-          while (true) {
-            if (use->node->is_in_hashcons()) {
-              _hashcons.erase(use->node);
-              use->node->_children[use->child_index] = root;
-              Node* other = _hashcons.get(use->node);
-              if (other == nullptr) {
-                _hashcons.insert(use->node);
-              } else {
-                queue.merge(use->node, other);
-              }
-              
-              if (prev != nullptr) {
-                prev->next = use;
-              }
-              prev = use;
-            }
-            
-            if (use == uses.last) {
-              break;
-            }
-            use = use->next;
+        for_each_user(uses, [&](Node* user, size_t child_index){
+          _hashcons.erase(user);
+          user->replace_child(child_index, root);
+          Node* other = _hashcons.get(user);
+          if (other == nullptr) {
+            _hashcons.insert(user);
+          } else {
+            queue.merge(user, other);
+            _evicted++;
           }
-        }
+        });
       }
       
+      compact_kind_index();
       return changed;
     }
     
-    // Node cost type used for extraction.
-    // Implements saturating arithmetic.
-    class Cost {
-    private:
-      uint64_t _value = 0;
-    public:
-      Cost() {}
-      Cost(uint64_t value): _value(value) {}
-      
-      static inline Cost inf() {
-        return Cost(~uint64_t(0));
-      } 
-      
-      inline uint64_t value() const { return _value; }
-      inline bool is_inf() const { return *this == Cost::inf(); }
-      
-      inline Cost operator+(const Cost& other) const {
-        uint64_t res = 0;
-        if (__builtin_add_overflow(_value, other._value, &res)) {
-          return Cost::inf();
-        } else {
-          return Cost(res);
-        }
+    // Deferred merging: Instead of restoring congruence after every
+    // union, merge_deferred only records the users of the absorbed
+    // class. A later call to rebuild re-canonicalizes every recorded
+    // user once, even if its class was merged multiple times in between.
+    // Until rebuild is called, the e-graph may contain congruent nodes
+    // which are not yet merged.
+    
+    bool merge_deferred(Node* a, Node* b) {
+      a = a->root();
+      b = b->root();
+      if (a == b) {
+        return false;
       }
       
-      inline Cost& operator+=(const Cost& other) {
-        *this = *this + other;
-        return *this;
-      }
+      auto [root, uses] = union_roots(a, b);
+      mark_pending(uses);
+      return true;
+    }
+    
+    bool merge_deferred(MergeQueue& queue) {
+      bool changed = false;
+      while (!queue.empty()) {
+        auto [a, b] = queue.pop();
+        changed = merge_deferred(a, b) || changed;
+      }
+      return changed;
+    }
+    
+    // Concurrent merging
+    // Between begin_concurrent_merge and end_concurrent_merge, multiple
+    // threads may unite equivalence classes using concurrent_merge.
+    // Each thread passes a distinct index below thread_count. Only the
+    // union find is updated during this phase, without locks: Roots are
+    // linked using compare-and-swap, always below the root with the
+    // higher priority (a hash of the node id), and finds use path
+    // halving. end_concurrent_merge then moves the nodes and uses of
+    // absorbed classes to their new roots. As with merge_deferred,
+    // congruence is restored by rebuild.
+    // No other operation may access the e-graph during this phase.
+    // See: Siddhartha V. Jayanti, Robert E. Tarjan. "A Randomized
+    // Concurrent Algorithm for Disjoint Set Union". PODC 2016
+    
+    void begin_concurrent_merge(size_t thread_count) {
+      assert(_concurrent_threads.empty());
+      _concurrent_threads.resize(thread_count);
+    }
+    
+  private:
+    static inline uint64_t link_priority(const Node* node) {
+      // Multiplying by an odd constant is a bijection, so no two nodes
+      // have the same priority.
+      return uint64_t(node->_id) * 0x9e3779b97f4a7c15;
+    }
+    
+    // Finds the root of a node using path halving
+    static Node* concurrent_find(Node* node) {
+      while (true) {
+        Node* up = __atomic_load_n(&node->_up, __ATOMIC_ACQUIRE);
+        if (up == nullptr) {
+          return node;
+        }
+        Node* up_up = __atomic_load_n(&up->_up, __ATOMIC_ACQUIRE);
+        if (up_up == nullptr) {
+          return up;
+        }
+        __atomic_compare_exchange_n(&node->_up, &up, up_up, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+        node = up_up;
+      }
+    }
+  public:
+    // Returns true if the classes were distinct
+    bool concurrent_merge(size_t thread, Node* a, Node* b) {
+      assert(thread < _concurrent_threads.size());
+      while (true) {
+        a = concurrent_find(a);
+        b = concurrent_find(b);
+        if (a == b) {
+          return false;
+        }
+        
+        if (link_priority(a) > link_priority(b)) {
+          std::swap(a, b);
+        }
+        
+        // Fails if a was linked by another thread in the meantime
+        Node* expected = nullptr;
+        if (__atomic_compare_exchange_n(&a->_up, &expected, b, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+          _concurrent_threads[thread].linked.push_back(a);
+          return true;
+        }
+      }
+    }
+    
+    void end_concurrent_merge() {
+      for (ConcurrentThread& thread : _concurrent_threads) {
+        for (Node* child : thread.linked) {
+          Node* root = child->root();
+          // Concurrent links ignore ranks, so the rank of a root may
+          // exceed what union by rank guarantees. Ranks saturate.
+          uint8_t rank = child->_rank == UINT8_MAX ? UINT8_MAX : uint8_t(child->_rank + 1);
+          root->_rank = std::max(root->_rank, rank);
+          mark_pending(child->absorb(root));
+          _roots.erase(child);
+          record_change(root);
+          join_analysis(root, child);
+        }
+      }
+      _concurrent_threads.clear();
+    }
+    
+    // Restores congruence after merge_deferred or end_concurrent_merge
+    // and propagates analysis data of the merged classes.
+    // Returns true if any additional classes were merged.
+    bool rebuild() {
+      bool changed = false;
+      MergeQueue queue;
+      while (!_pending.empty() || analyze(queue)) {
+        std::vector<Node*> pending;
+        std::swap(pending, _pending);
+        
+        for (Node* node : pending) {
+          node->_pending = false;
+          if (!node->is_in_hashcons() || node->is_canonical()) {
+            continue;
+          }
+          
+          _hashcons.erase(node);
+          for (size_t it = 0; it < node->_child_count; it++) {
+            node->replace_child(it, node->_children[it]->root());
+          }
+          Node* other = _hashcons.get(node);
+          if (other == nullptr) {
+            _hashcons.insert(node);
+          } else {
+            queue.merge(node, other);
+            _evicted++;
+          }
+        }
+        
+        changed = merge_deferred(queue) || changed;
+      }
+      
+      compact_kind_index();
+      return changed;
+    }
+    
+    inline bool is_clean() const { return _pending.empty(); }
+    
+    // The current epoch is the number of changes (created nodes and
+    // unions) made to the e-graph so far.
+    inline uint64_t epoch() const { return _changes.size(); }
+    
+    // Calls fn(root) once for every root whose equivalence class changed
+    // after the given epoch or which reaches such a class within `depth`
+    // steps along the children of its nodes.
+    // The e-graph must be clean (see rebuild).
+    template <class Fn>
+    void changed_since(uint64_t since, size_t depth, const Fn& fn) {
+      std::unordered_set<Node*> visited;
+      std::vector<Node*> frontier;
+      for (size_t it = since; it < _changes.size(); it++) {
+        Node* root = _changes[it]->root();
+        if (visited.insert(root).second) {
+          frontier.push_back(root);
+          fn(root);
+        }
+      }
+      
+      std::vector<Node*> next;
+      for (size_t level = 0; level < depth && !frontier.empty(); level++) {
+        for (Node* node : frontier) {
+          for_each_user_of(node, [&](Node* user){
+            Node* root = user->root();
+            if (visited.insert(root).second) {
+              next.push_back(root);
+              fn(root);
+            }
+          });
+        }
+        frontier.clear();
+        std::swap(frontier, next);
+      }
+    }
+    
+    // Patterns
+    // A pattern is either a variable or a node pattern with child patterns.
+    // Node patterns match nodes either by their kind or by their full data.
+    // Variables are identified by indices, so `Not(And(?0, ?1))` is written as
+    //   Pattern(NodeKind::Not, {Pattern(NodeKind::And, {Pattern::var(0), Pattern::var(1)})})
+    class Pattern {
+    private:
+      size_t _var = 0;
+      std::optional<NodeKind> _kind;
+      std::optional<NodeData> _data;
+      std::vector<Pattern> _children;
+      
+      Pattern() {}
+    public:
+      Pattern(const NodeKind& kind, const std::vector<Pattern>& children = {}):
+        _kind(kind), _children(children) {}
+      
+      Pattern(const NodeData& data, const std::vector<Pattern>& children = {}):
+        _kind(data.kind()), _data(data), _children(children) {}
+      
+      static Pattern var(size_t index) {
+        Pattern pattern;
+        pattern._var = index;
+        return pattern;
+      }
+      
+      inline bool is_var() const { return !_kind.has_value(); }
+      inline size_t var_index() const { return _var; }
+      inline const NodeKind& kind() const { return _kind.value(); }
+      inline const std::optional<NodeData>& data() const { return _data; }
+      inline const std::vector<Pattern>& children() const { return _children; }
+      
+      // Number of variables, assuming variables are numbered densely
+      size_t var_count() const {
+        if (is_var()) {
+          return _var + 1;
+        }
+        size_t count = 0;
+        for (const Pattern& child : _children) {
+          count = std::max(count, child.var_count());
+        }
+        return count;
+      }
+      
+      // Nesting depth of node patterns. Variables have depth 0.
+      size_t depth() const {
+        size_t depth = 0;
+        for (const Pattern& child : _children) {
+          depth = std::max(depth, child.depth());
+        }
+        return is_var() ? 0 : depth + 1;
+      }
+      
+      void write(std::ostream& stream) const {
+        if (is_var()) {
+          stream << '?' << _var;
+          return;
+        }
+        
+        if (_data.has_value()) {
+          stream << _data.value();
+        } else {
+          stream << _kind.value();
+        }
+        
+        if (!_children.empty()) {
+          stream << '(';
+          bool is_first = true;
+          for (const Pattern& child : _children) {
+            if (!is_first) {
+              stream << ", ";
+            }
+            child.write(stream);
+            is_first = false;
+          }
+          stream << ')';
+        }
+      }
+    };
+    
+    // A match of a pattern. Root is the root node of the equivalence
+    // class matched by the pattern and subst maps every variable to the
+    // root node of its equivalence class.
+    struct Match {
+      Node* root = nullptr;
+      std::vector<Node*> subst;
+      
+      Match() {}
+      Match(Node* _root, const std::vector<Node*>& _subst):
+        root(_root), subst(_subst) {}
+    };
+    
+    // A pattern compiled into a flat instruction sequence which is
+    // executed by a small backtracking virtual machine.
+    // Registers hold root nodes of equivalence classes. Register 0 is
+    // the class matched by the whole pattern.
+    class Program {
+    private:
+      struct Instruction {
+        enum class Op {
+          // Iterates all nodes in the class of `reg` which match `kind`,
+          // `data` and `arity` and loads their children into the
+          // registers starting at `out`.
+          Bind,
+          // Continues only if `reg` and `other` hold the same class
+          Compare,
+          // Reports a match
+          Yield
+        };
+        
+        Op op;
+        size_t reg = 0;
+        size_t other = 0;
+        size_t arity = 0;
+        std::optional<NodeKind> kind;
+        std::optional<NodeData> data;
+        
+        Instruction(Op _op): op(_op) {}
+        
+        bool matches(const Node* node) const {
+          return node->_child_count == arity &&
+                 (data.has_value() ? node->data() == data.value()
+                                   : node->data().kind() == kind.value());
+        }
+      };
+      
+      std::vector<Instruction> _instructions;
+      std::vector<size_t> _var_regs;
+      size_t _reg_count = 1;
+      size_t _depth = 0;
+      std::optional<NodeKind> _root_kind;
+      
+      void compile(const Pattern& pattern, size_t reg) {
+        if (pattern.is_var()) {
+          size_t var = pattern.var_index();
+          if (_var_regs[var] == NONE) {
+            _var_regs[var] = reg;
+          } else {
+            Instruction instr(Instruction::Op::Compare);
+            instr.reg = _var_regs[var];
+            instr.other = reg;
+            _instructions.push_back(instr);
+          }
+        } else {
+          Instruction instr(Instruction::Op::Bind);
+          instr.reg = reg;
+          instr.other = _reg_count;
+          instr.arity = pattern.children().size();
+          instr.kind = pattern.kind();
+          instr.data = pattern.data();
+          _instructions.push_back(instr);
+          
+          size_t out = _reg_count;
+          _reg_count += pattern.children().size();
+          for (size_t it = 0; it < pattern.children().size(); it++) {
+            compile(pattern.children()[it], out + it);
+          }
+        }
+      }
+      
+      // Loads the children of node into the output registers of the
+      // given bind instruction.
+      // If ReadOnly is set, the e-graph is not modified, so multiple
+      // threads may search at once.
+      template <bool ReadOnly = false>
+      static inline void load(const Instruction& instr, Node* node, std::vector<Node*>& regs) {
+        for (size_t it = 0; it < instr.arity; it++) {
+          Node* child = node->_children[it];
+          regs[instr.other + it] = ReadOnly ? child->find() : child->root();
+        }
+      }
+      
+      template <bool ReadOnly = false, class Fn>
+      void run(size_t pc, std::vector<Node*>& regs, std::vector<Node*>& subst, const Fn& fn) const {
+        const Instruction& instr = _instructions[pc];
+        switch (instr.op) {
+          case Instruction::Op::Bind: {
+            EClass e_class(regs[instr.reg]);
+            if (!e_class.may_contain(instr.kind.value())) {
+              break;
+            }
+            auto bind = [&](Node* node){
+              if (instr.matches(node)) {
+                load<ReadOnly>(instr, node, regs);
+                run<ReadOnly>(pc + 1, regs, subst, fn);
+              }
+            };
+            if constexpr (ReadOnly) {
+              for (Node* node : e_class.read_only()) {
+                bind(node);
+              }
+            } else {
+              for (Node* node : e_class) {
+                bind(node);
+              }
+            }
+          }
+          break;
+          case Instruction::Op::Compare:
+            if (regs[instr.reg] == regs[instr.other]) {
+              run<ReadOnly>(pc + 1, regs, subst, fn);
+            }
+          break;
+          case Instruction::Op::Yield:
+            for (size_t it = 0; it < _var_regs.size(); it++) {
+              subst[it] = _var_regs[it] == NONE ? nullptr : regs[_var_regs[it]];
+            }
+            fn(regs[0], (const std::vector<Node*>&)subst);
+          break;
+        }
+      }
+    public:
+      static constexpr const size_t NONE = ~size_t(0);
+      
+      explicit Program(const Pattern& pattern) {
+        _var_regs.resize(pattern.var_count(), NONE);
+        if (!pattern.is_var()) {
+          _root_kind = pattern.kind();
+        }
+        _depth = pattern.depth();
+        compile(pattern, 0);
+        _instructions.push_back(Instruction(Instruction::Op::Yield));
+      }
+      
+      inline size_t var_count() const { return _var_regs.size(); }
+      inline size_t size() const { return _instructions.size(); }
+      
+      // Calls fn(root, subst) for every match rooted in the equivalence
+      // class of root.
+      template <class Fn>
+      void search_class(Node* root, const Fn& fn) const {
+        std::vector<Node*> regs(_reg_count, nullptr);
+        std::vector<Node*> subst(var_count(), nullptr);
+        regs[0] = root->root();
+        run(0, regs, subst, fn);
+      }
+      
+      // Calls fn(root, subst) for every match in the e-graph.
+      // The e-graph must be clean (see EGraph::rebuild).
+      // If the pattern is rooted in a node pattern, only nodes of the
+      // pattern's kind are visited.
+      template <class Fn>
+      void search(EGraph& e_graph, const Fn& fn) const {
+        std::vector<Node*> regs(_reg_count, nullptr);
+        std::vector<Node*> subst(var_count(), nullptr);
+        
+        if (!_root_kind.has_value()) {
+          // fn may create nodes, which inserts into the set of roots
+          std::vector<Node*> roots(e_graph.roots().begin(), e_graph.roots().end());
+          for (Node* root : roots) {
+            regs[0] = root;
+            run(0, regs, subst, fn);
+          }
+          return;
+        }
+        
+        // Executes the first bind instruction directly on the node
+        const Instruction& root_instr = _instructions[0];
+        for (Node* node : e_graph.nodes_of_kind(_root_kind.value())) {
+          if (root_instr.matches(node)) {
+            regs[0] = node->root();
+            load(root_instr, node, regs);
+            run(1, regs, subst, fn);
+          }
+        }
+      }
+      
+      std::vector<Match> search(EGraph& e_graph) const {
+        std::vector<Match> matches;
+        search(e_graph, [&](Node* root, const std::vector<Node*>& subst){
+          matches.emplace_back(root, subst);
+        });
+        return matches;
+      }
+      
+      // Semi-naive search: Calls fn(root, subst) for every match which
+      // involves at least one equivalence class that changed after the
+      // given epoch (see EGraph::epoch). Matches which only involve
+      // unchanged classes were already found by a previous search.
+      // Only classes within the pattern's depth of a changed class are
+      // visited. The e-graph must be clean (see EGraph::rebuild).
+      template <class Fn>
+      void search_since(EGraph& e_graph, uint64_t since, const Fn& fn) const {
+        if (since == 0) {
+          search(e_graph, fn);
+          return;
+        }
+        
+        std::vector<Node*> regs(_reg_count, nullptr);
+        std::vector<Node*> subst(var_count(), nullptr);
+        
+        // All classes involved in a match are held in the registers
+        auto yield = [&](Node* root, const std::vector<Node*>& subst){
+          for (Node* reg : regs) {
+            if (reg->_timestamp > since) {
+              fn(root, subst);
+              return;
+            }
+          }
+        };
+        
+        e_graph.changed_since(since, _depth, [&](Node* root){
+          regs[0] = root;
+          run(0, regs, subst, yield);
+        });
+      }
+      
+      std::vector<Match> search_since(EGraph& e_graph, uint64_t since) const {
+        std::vector<Match> matches;
+        search_since(e_graph, since, [&](Node* root, const std::vector<Node*>& subst){
+          matches.emplace_back(root, subst);
+        });
+        return matches;
+      }
+    private:
+      // Number of root nodes or classes searched by one parallel task
+      static constexpr const size_t CHUNK_SIZE = 64;
+      
+      // Searches chunks of the items [0, count) in parallel and
+      // concatenates the matches of all chunks. Each chunk collects its
+      // matches into a separate buffer, so the result does not depend
+      // on scheduling. search_item(index, regs, subst, fn) starts the
+      // search for a single item.
+      template <class SearchItem>
+      std::vector<Match> search_parallel(ThreadPool& pool,
+                                         size_t count,
+                                         const SearchItem& search_item) const {
+        size_t chunk_count = (count + CHUNK_SIZE - 1) / CHUNK_SIZE;
+        std::vector<std::vector<Match>> buffers(chunk_count);
+        pool.parallel_for(chunk_count, [&](size_t chunk, size_t thread){
+          std::vector<Node*> regs(_reg_count, nullptr);
+          std::vector<Node*> subst(var_count(), nullptr);
+          std::vector<Match>& buffer = buffers[chunk];
+          auto collect = [&](Node* root, const std::vector<Node*>& subst){
+            buffer.emplace_back(root, subst);
+          };
+          
+          size_t end = std::min(count, (chunk + 1) * CHUNK_SIZE);
+          for (size_t index = chunk * CHUNK_SIZE; index < end; index++) {
+            search_item(index, regs, subst, collect);
+          }
+        });
+        
+        std::vector<Match> matches;
+        for (std::vector<Match>& buffer : buffers) {
+          matches.insert(matches.end(), buffer.begin(), buffer.end());
+        }
+        return matches;
+      }
+      
+      // Parallel search starting from the given root nodes
+      template <class Filter>
+      std::vector<Match> search_roots_parallel(ThreadPool& pool,
+                                               const std::vector<Node*>& roots,
+                                               const Filter& filter) const {
+        return search_parallel(pool, roots.size(), [&](size_t index,
+                                                       std::vector<Node*>& regs,
+                                                       std::vector<Node*>& subst,
+                                                       const auto& collect){
+          regs[0] = roots[index];
+          run<true>(0, regs, subst, [&](Node* root, const std::vector<Node*>& subst){
+            if (filter(regs)) {
+              collect(root, subst);
+            }
+          });
+        });
+      }
+    public:
+      // Parallel version of search. Matching does not modify the
+      // e-graph, so the nodes of the pattern's root kind (or all
+      // classes, if the pattern is a variable) are partitioned across
+      // the threads of the pool. Returns the same matches in the same
+      // order as the sequential search.
+      std::vector<Match> search(EGraph& e_graph, ThreadPool& pool) const {
+        if (!_root_kind.has_value()) {
+          std::vector<Node*> roots(e_graph.roots().begin(), e_graph.roots().end());
+          return search_roots_parallel(pool, roots, [](const std::vector<Node*>& regs){
+            return true;
+          });
+        }
+        
+        NodeList nodes = e_graph.nodes_of_kind(_root_kind.value());
+        const Instruction& root_instr = _instructions[0];
+        return search_parallel(pool, nodes.size(), [&](size_t index,
+                                                       std::vector<Node*>& regs,
+                                                       std::vector<Node*>& subst,
+                                                       const auto& collect){
+          Node* node = nodes.at(index);
+          if (node->is_in_hashcons() && root_instr.matches(node)) {
+            regs[0] = node->find();
+            load<true>(root_instr, node, regs);
+            run<true>(1, regs, subst, collect);
+          }
+        });
+      }
+      
+      // Parallel version of search_since. The candidate classes are
+      // collected sequentially and then searched in parallel.
+      std::vector<Match> search_since(EGraph& e_graph, uint64_t since, ThreadPool& pool) const {
+        if (since == 0) {
+          return search(e_graph, pool);
+        }
+        
+        std::vector<Node*> roots;
+        e_graph.changed_since(since, _depth, [&](Node* root){
+          roots.push_back(root);
+        });
+        
+        return search_roots_parallel(pool, roots, [&](const std::vector<Node*>& regs){
+          for (Node* reg : regs) {
+            if (reg->_timestamp > since) {
+              return true;
+            }
+          }
+          return false;
+        });
+      }
+    };
+    
+    // Relational e-matching
+    // A pattern is translated into a conjunctive query: Every node
+    // pattern becomes an atom over the relation of nodes with its kind,
+    // whose columns are the class of the node and the classes of its
+    // children. The query is then evaluated using generic join, which
+    // binds one variable at a time by intersecting the candidates from
+    // all atoms containing it. This is worst-case optimal and avoids
+    // the quadratic blowup of backtracking on patterns with repeated
+    // variables like And(?x, Not(?x)).
+    // See: Yihong Zhang et al. "Relational E-Matching". POPL 2022
+    class Query {
+    private:
+      struct Atom {
+        NodeKind kind;
+        std::optional<NodeData> data;
+        // Query variable of the node's class followed by the query
+        // variables of its children
+        std::vector<size_t> columns;
+        // Distinct query variables in the order they are bound
+        std::vector<size_t> vars;
+        
+        Atom(const NodeKind& _kind, const std::optional<NodeData>& _data):
+          kind(_kind), data(_data) {}
+      };
+      
+      // Tuples of class ids matching an atom (one per entry in the
+      // atom's vars), sorted lexicographically and stored without
+      // padding. Relations are built by every search, so that searching
+      // does not modify the query.
+      struct Relation {
+        size_t width = 0;
+        std::vector<uint32_t> tuples;
+        
+        inline size_t tuple_count() const { return tuples.size() / width; }
+        inline uint32_t at(size_t tuple, size_t column) const { return tuples[tuple * width + column]; }
+      };
+      
+      struct Range {
+        size_t begin = 0;
+        size_t end = 0;
+        
+        inline bool empty() const { return begin == end; }
+        inline size_t size() const { return end - begin; }
+      };
+      
+      std::vector<Atom> _atoms;
+      size_t _query_var_count = 0;
+      size_t _root = 0;
+      // Pattern variable of a pattern which is a bare variable
+      size_t _root_var = NONE;
+      // Maps pattern variables to query variables
+      std::vector<size_t> _pattern_vars;
+      // Order in which query variables are bound
+      std::vector<size_t> _order;
+      // Atoms containing the query variable, and the column of the
+      // variable within the atom's tuples
+      std::vector<std::vector<std::pair<size_t, size_t>>> _occurrences;
+      
+      size_t add(const Pattern& pattern) {
+        if (pattern.is_var()) {
+          size_t& var = _pattern_vars[pattern.var_index()];
+          if (var == NONE) {
+            var = _query_var_count++;
+          }
+          return var;
+        }
+        
+        size_t var = _query_var_count++;
+        std::vector<size_t> columns;
+        columns.push_back(var);
+        for (const Pattern& child : pattern.children()) {
+          columns.push_back(add(child));
+        }
+        
+        Atom atom(pattern.kind(), pattern.data());
+        atom.columns = columns;
+        _atoms.push_back(atom);
+        return var;
+      }
+      
+      void plan() {
+        // Variables occurring in more atoms are bound first, since they
+        // constrain the search the most.
+        std::vector<size_t> counts(_query_var_count, 0);
+        for (const Atom& atom : _atoms) {
+          std::unordered_set<size_t> vars(atom.columns.begin(), atom.columns.end());
+          for (size_t var : vars) {
+            counts[var]++;
+          }
+        }
+        
+        for (size_t var = 0; var < _query_var_count; var++) {
+          _order.push_back(var);
+        }
+        std::stable_sort(_order.begin(), _order.end(), [&](size_t a, size_t b){
+          return counts[a] > counts[b];
+        });
+        
+        std::vector<size_t> positions(_query_var_count, 0);
+        for (size_t it = 0; it < _order.size(); it++) {
+          positions[_order[it]] = it;
+        }
+        
+        _occurrences.resize(_query_var_count);
+        for (size_t index = 0; index < _atoms.size(); index++) {
+          Atom& atom = _atoms[index];
+          atom.vars = atom.columns;
+          std::sort(atom.vars.begin(), atom.vars.end(), [&](size_t a, size_t b){
+            return positions[a] < positions[b];
+          });
+          atom.vars.erase(std::unique(atom.vars.begin(), atom.vars.end()), atom.vars.end());
+          for (size_t column = 0; column < atom.vars.size(); column++) {
+            _occurrences[atom.vars[column]].emplace_back(index, column);
+          }
+        }
+      }
+      
+      // Builds the sorted tuples of an atom from the e-graph
+      static Relation load(const Atom& atom, EGraph& e_graph) {
+        size_t width = atom.vars.size();
+        std::vector<uint32_t> tuples;
+        std::vector<uint32_t> tuple(width);
+        std::vector<uint32_t> values(atom.columns.size());
+        
+        for (Node* node : e_graph.nodes_of_kind(atom.kind)) {
+          if (node->_child_count + 1 != atom.columns.size() ||
+              (atom.data.has_value() && node->data() != atom.data.value())) {
+            continue;
+          }
+          
+          values[0] = node->root()->_id;
+          for (size_t it = 0; it < node->_child_count; it++) {
+            values[it + 1] = node->_children[it]->root()->_id;
+          }
+          
+          // Columns which refer to the same variable must be equal
+          bool is_consistent = true;
+          for (size_t var = 0; var < width && is_consistent; var++) {
+            bool is_set = false;
+            for (size_t column = 0; column < values.size(); column++) {
+              if (atom.columns[column] == atom.vars[var]) {
+                if (is_set && tuple[var] != values[column]) {
+                  is_consistent = false;
+                  break;
+                }
+                tuple[var] = values[column];
+                is_set = true;
+              }
+            }
+          }
+          
+          if (is_consistent) {
+            tuples.insert(tuples.end(), tuple.begin(), tuple.end());
+          }
+        }
+        
+        // Sort and deduplicate tuples
+        size_t count = tuples.size() / width;
+        std::vector<size_t> order(count);
+        for (size_t it = 0; it < count; it++) {
+          order[it] = it;
+        }
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b){
+          return std::lexicographical_compare(
+            tuples.begin() + a * width, tuples.begin() + (a + 1) * width,
+            tuples.begin() + b * width, tuples.begin() + (b + 1) * width
+          );
+        });
+        
+        Relation relation;
+        relation.width = width;
+        for (size_t it = 0; it < count; it++) {
+          auto begin = tuples.begin() + order[it] * width;
+          if (it > 0 && std::equal(begin, begin + width, relation.tuples.end() - width)) {
+            continue;
+          }
+          relation.tuples.insert(relation.tuples.end(), begin, begin + width);
+        }
+        return relation;
+      }
+      
+      // Narrows a range of tuples, whose columns before `column` are
+      // fixed, to the tuples whose value in `column` is `value`.
+      static Range narrow(const Relation& relation, const Range& range, size_t column, uint32_t value) {
+        size_t begin = range.begin;
+        size_t end = range.end;
+        while (begin < end) {
+          size_t mid = begin + (end - begin) / 2;
+          if (relation.at(mid, column) < value) {
+            begin = mid + 1;
+          } else {
+            end = mid;
+          }
+        }
+        
+        Range result;
+        result.begin = begin;
+        end = range.end;
+        while (begin < end) {
+          size_t mid = begin + (end - begin) / 2;
+          if (relation.at(mid, column) <= value) {
+            begin = mid + 1;
+          } else {
+            end = mid;
+          }
+        }
+        result.end = begin;
+        return result;
+      }
+      
+      template <class Fn>
+      void join(size_t depth,
+                const std::vector<Relation>& relations,
+                std::vector<Range>& ranges,
+                std::vector<uint32_t>& binding,
+                std::vector<Node*>& subst,
+                EGraph& e_graph,
+                const Fn& fn) const {
+        
+        if (depth == _order.size()) {
+          for (size_t it = 0; it < _pattern_vars.size(); it++) {
+            subst[it] = _pattern_vars[it] == NONE ? nullptr : e_graph.node_by_id(binding[_pattern_vars[it]]);
+          }
+          fn(e_graph.node_by_id(binding[_root]), (const std::vector<Node*>&)subst);
+          return;
+        }
+        
+        size_t var = _order[depth];
+        const std::vector<std::pair<size_t, size_t>>& occurrences = _occurrences[var];
+        
+        // Enumerate candidates from the smallest range
+        size_t smallest = 0;
+        for (size_t it = 1; it < occurrences.size(); it++) {
+          if (ranges[occurrences[it].first].size() < ranges[occurrences[smallest].first].size()) {
+            smallest = it;
+          }
+        }
+        
+        auto [smallest_atom, smallest_column] = occurrences[smallest];
+        Range candidates = ranges[smallest_atom];
+        std::vector<Range> saved(occurrences.size());
+        for (size_t it = 0; it < occurrences.size(); it++) {
+          saved[it] = ranges[occurrences[it].first];
+        }
+        
+        size_t tuple = candidates.begin;
+        while (tuple < candidates.end) {
+          uint32_t value = relations[smallest_atom].at(tuple, smallest_column);
+          
+          bool is_match = true;
+          for (size_t it = 0; it < occurrences.size(); it++) {
+            auto [atom, column] = occurrences[it];
+            ranges[atom] = narrow(relations[atom], saved[it], column, value);
+            if (ranges[atom].empty()) {
+              is_match = false;
+              break;
+            }
+          }
+          
+          if (is_match) {
+            binding[var] = value;
+            join(depth + 1, relations, ranges, binding, subst, e_graph, fn);
+          }
+          
+          // Skip to the next distinct value
+          tuple = narrow(relations[smallest_atom], Range {tuple, candidates.end}, smallest_column, value).end;
+        }
+        
+        for (size_t it = 0; it < occurrences.size(); it++) {
+          ranges[occurrences[it].first] = saved[it];
+        }
+      }
+    public:
+      static constexpr const size_t NONE = ~size_t(0);
+      
+      explicit Query(const Pattern& pattern) {
+        _pattern_vars.resize(pattern.var_count(), NONE);
+        if (pattern.is_var()) {
+          _root_var = pattern.var_index();
+        }
+        _root = add(pattern);
+        plan();
+      }
+      
+      inline size_t var_count() const { return _pattern_vars.size(); }
+      
+      // Calls fn(root, subst) for every match in the e-graph.
+      // The e-graph must be clean (see EGraph::rebuild). All matches
+      // are computed from the e-graph at the start of the search, so fn
+      // may create nodes, but must not merge classes.
+      template <class Fn>
+      void search(EGraph& e_graph, const Fn& fn) const {
+        std::vector<Node*> subst(var_count(), nullptr);
+        
+        if (_atoms.empty()) {
+          std::vector<Node*> roots(e_graph.roots().begin(), e_graph.roots().end());
+          for (Node* root : roots) {
+            subst[_root_var] = root;
+            fn(root, (const std::vector<Node*>&)subst);
+          }
+          return;
+        }
+        
+        std::vector<Relation> relations;
+        std::vector<Range> ranges;
+        for (const Atom& atom : _atoms) {
+          relations.push_back(load(atom, e_graph));
+          ranges.push_back(Range {0, relations.back().tuple_count()});
+        }
+        
+        std::vector<uint32_t> binding(_query_var_count, 0);
+        join(0, relations, ranges, binding, subst, e_graph, fn);
+      }
+      
+      std::vector<Match> search(EGraph& e_graph) const {
+        std::vector<Match> matches;
+        search(e_graph, [&](Node* root, const std::vector<Node*>& subst){
+          matches.emplace_back(root, subst);
+        });
+        return matches;
+      }
+    };
+    
+    // Adds the nodes of a pattern to the e-graph, replacing variables
+    // by the nodes in subst. Node patterns which only specify a kind
+    // require NodeData to be constructible from NodeKind.
+    Node* instantiate(const Pattern& pattern, const std::vector<Node*>& subst) {
+      if (pattern.is_var()) {
+        return subst.at(pattern.var_index())->root();
+      }
+      
+      std::vector<Node*> children;
+      children.reserve(pattern.children().size());
+      for (const Pattern& child : pattern.children()) {
+        children.push_back(instantiate(child, subst));
+      }
+      
+      if (pattern.data().has_value()) {
+        return node(pattern.data().value(), children);
+      } else {
+        return node(NodeData(pattern.kind()), children);
+      }
+    }
+    
+    // Like instantiate, but may be called by multiple threads during the
+    // concurrent phase (see begin_concurrent). Returns nullptr if the
+    // node limit of the phase was reached.
+    Node* concurrent_instantiate(size_t thread, const Pattern& pattern, const std::vector<Node*>& subst) {
+      if (pattern.is_var()) {
+        return subst.at(pattern.var_index())->find();
+      }
+      
+      std::vector<Node*> children;
+      children.reserve(pattern.children().size());
+      for (const Pattern& child : pattern.children()) {
+        Node* node = concurrent_instantiate(thread, child, subst);
+        if (node == nullptr) {
+          return nullptr;
+        }
+        children.push_back(node);
+      }
+      
+      if (pattern.data().has_value()) {
+        return concurrent_node(thread, pattern.data().value(), children);
+      } else {
+        return concurrent_node(thread, NodeData(pattern.kind()), children);
+      }
+    }
+    
+    // Rewrite rule. Every match of the left hand side is passed to the
+    // applier, which queues merges. If the right hand side is a
+    // pattern, it is instantiated and merged with the matched class.
+    class Rule {
+    public:
+      using Applier = std::function<void(EGraph&, Node* root, const std::vector<Node*>& subst, MergeQueue&)>;
+    private:
+      std::string _name;
+      Pattern _lhs;
+      Program _program;
+      Applier _applier;
+    public:
+      Rule(const std::string& name, const Pattern& lhs, const Applier& applier):
+        _name(name), _lhs(lhs), _program(lhs), _applier(applier) {}
+      
+      Rule(const std::string& name, const Pattern& lhs, const Pattern& rhs):
+        Rule(name, lhs, [rhs](EGraph& e_graph, Node* root, const std::vector<Node*>& subst, MergeQueue& queue){
+          queue.merge(root, e_graph.instantiate(rhs, subst));
+        }) {}
+      
+      inline const std::string& name() const { return _name; }
+      inline const Pattern& lhs() const { return _lhs; }
+      inline const Program& program() const { return _program; }
+      
+      void apply(EGraph& e_graph, const Match& match, MergeQueue& queue) const {
+        _applier(e_graph, match.root, match.subst, queue);
+      }
+    };
+    
+    // Equality saturation driver. Applies rules until the e-graph is
+    // saturated or one of the limits is reached. Each iteration first
+    // searches all rules and then applies all matches, so the order of
+    // rules does not matter. Rules are searched semi-naively: Only
+    // matches involving classes which changed since the rule was last
+    // searched are found.
+    class Runner {
+    public:
+      struct Report {
+        StopReason stop_reason = StopReason::Saturated;
+        size_t iterations = 0;
+        size_t matches = 0;
+        double seconds = 0.0;
+      };
+    private:
+      using Clock = std::chrono::steady_clock;
+      
+      size_t _iteration_limit = 30;
+      size_t _node_limit = 10000;
+      size_t _memory_limit = SIZE_MAX;
+      double _time_limit = 5.0;
+      
+      ThreadPool* _thread_pool = nullptr;
+      
+      static double seconds_since(const Clock::time_point& start) {
+        return std::chrono::duration<double>(Clock::now() - start).count();
+      }
+      
+      std::optional<StopReason> check_limits(EGraph& e_graph, const Clock::time_point& start) const {
+        if (e_graph.node_count() > _node_limit) {
+          return StopReason::NodeLimit;
+        } else if (e_graph.memory_usage() > _memory_limit) {
+          return StopReason::MemoryLimit;
+        } else if (seconds_since(start) > _time_limit) {
+          return StopReason::TimeLimit;
+        }
+        return {};
+      }
+    public:
+      Runner() {}
+      
+      // Maximum number of iterations
+      Runner& iteration_limit(size_t limit) { _iteration_limit = limit; return *this; }
+      // Maximum number of nodes created in the e-graph (see EGraph::node_count)
+      Runner& node_limit(size_t limit) { _node_limit = limit; return *this; }
+      // Maximum number of bytes allocated by the e-graph (see EGraph::memory_usage)
+      Runner& memory_limit(size_t limit) { _memory_limit = limit; return *this; }
+      // Maximum wall-clock time in seconds
+      Runner& time_limit(double limit) { _time_limit = limit; return *this; }
+      // Searches rules in parallel using the given thread pool. Matches
+      // are still applied sequentially.
+      Runner& thread_pool(ThreadPool* pool) { _thread_pool = pool; return *this; }
+      
+      // Limits are checked before every iteration and after applying
+      // the matches of each rule, so they may be exceeded by the
+      // changes of a single rule.
+      // Rules which are not applied in an iteration (see Scheduler) are
+      // searched since their last application once they are allowed
+      // again, so no matches are lost.
+      template <class Scheduler>
+      Report run(EGraph& e_graph, const std::vector<Rule>& rules, Scheduler& scheduler) const {
+        Clock::time_point start = Clock::now();
+        Report report;
+        
+        e_graph.rebuild();
+        
+        // Epoch in which each rule was last searched
+        std::vector<uint64_t> epochs(rules.size(), 0);
+        std::vector<std::vector<Match>> matches(rules.size());
+        MergeQueue queue;
+        
+        while (true) {
+          if (report.iterations >= _iteration_limit) {
+            report.stop_reason = StopReason::IterationLimit;
+            break;
+          }
+          
+          if (std::optional<StopReason> reason = check_limits(e_graph, start)) {
+            report.stop_reason = reason.value();
+            break;
+          }
+          
+          size_t iteration = report.iterations;
+          uint64_t epoch = e_graph.epoch();
+          for (size_t it = 0; it < rules.size(); it++) {
+            matches[it].clear();
+            if (!scheduler.can_search(iteration, it)) {
+              continue;
+            }
+            if (_thread_pool != nullptr) {
+              matches[it] = rules[it].program().search_since(e_graph, epochs[it], *_thread_pool);
+            } else {
+              matches[it] = rules[it].program().search_since(e_graph, epochs[it]);
+            }
+            if (scheduler.can_apply(iteration, it, matches[it].size())) {
+              epochs[it] = epoch;
+            } else {
+              matches[it].clear();
+            }
+          }
+          
+          std::optional<StopReason> reason;
+          for (size_t it = 0; it < rules.size() && !reason.has_value(); it++) {
+            for (const Match& match : matches[it]) {
+              rules[it].apply(e_graph, match, queue);
+            }
+            report.matches += matches[it].size();
+            reason = check_limits(e_graph, start);
+          }
+          
+          e_graph.merge(queue);
+          report.iterations++;
+          
+          if (reason.has_value()) {
+            report.stop_reason = reason.value();
+            break;
+          }
+          
+          if (e_graph.epoch() == epoch && scheduler.can_stop(iteration)) {
+            report.stop_reason = StopReason::Saturated;
+            break;
+          }
+        }
+        
+        report.seconds = seconds_since(start);
+        return report;
+      }
+      
+      Report run(EGraph& e_graph, const std::vector<Rule>& rules) const {
+        SimpleScheduler scheduler;
+        return run(e_graph, rules, scheduler);
+      }
+    };
+    
+    // Node cost type used for extraction.
+    // Implements saturating arithmetic.
+    class Cost {
+    private:
+      uint64_t _value = 0;
+    public:
+      Cost() {}
+      Cost(uint64_t value): _value(value) {}
+      
+      static inline Cost inf() {
+        return Cost(~uint64_t(0));
+      } 
+      
+      inline uint64_t value() const { return _value; }
+      inline bool is_inf() const { return *this == Cost::inf(); }
+      
+      inline Cost operator+(const Cost& other) const {
+        uint64_t res = 0;
+        if (__builtin_add_overflow(_value, other._value, &res)) {
+          return Cost::inf();
+        } else {
+          return Cost(res);
+        }
+      }
+      
+      inline Cost& operator+=(const Cost& other) {
+        *this = *this + other;
+        return *this;
+      }
+      
+      #define cmp(op) \
+        inline bool operator op(const Cost& other) const { \
+          return _value op other._value; \
+        }
+      
+      cmp(==)
+      cmp(!=)
+      cmp(<=)
+      cmp(<)
+      cmp(>=)
+      cmp(>)
+      
+      #undef cmp
+    };
+    
+    // Dense numbering of the equivalence classes, assigned once at the
+    // start of extraction. Classes are numbered in order of the ids of
+    // their root nodes.
+    class ClassIndex {
+    private:
+      static constexpr uint32_t NONE = ~uint32_t(0);
+      
+      // Class index by node id - offset, NONE for non-root nodes.
+      // Only used if the indexed nodes make up a large enough fraction
+      // of the id span. Otherwise, e.g. for a cone which contains an old
+      // leaf and a recent root, the indices are stored in a hash map so
+      // that memory usage does not depend on the size of the e-graph.
+      bool _dense = true;
+      uint32_t _offset = 0;
+      std::vector<uint32_t> _indices;
+      std::unordered_map<uint32_t, uint32_t> _sparse;
+      std::vector<Node*> _roots;
+    public:
+      ClassIndex() {}
+      
+      // Indexes the root nodes among nodes, which must be sorted by id
+      explicit ClassIndex(const std::vector<Node*>& nodes) {
+        if (!nodes.empty()) {
+          _offset = nodes.front()->_id;
+          size_t span = nodes.back()->_id - _offset + 1;
+          _dense = span <= nodes.size() * 4;
+          if (_dense) {
+            _indices.resize(span, NONE);
+          }
+        }
+        for (Node* node : nodes) {
+          if (node->_up == nullptr) {
+            if (_dense) {
+              _indices[node->_id - _offset] = uint32_t(_roots.size());
+            } else {
+              _sparse.insert({node->_id, uint32_t(_roots.size())});
+            }
+            _roots.push_back(node);
+          }
+        }
+      }
+      
+      inline size_t size() const { return _roots.size(); }
+      inline Node* root(size_t index) const { return _roots[index]; }
+      const std::vector<Node*>& roots() const { return _roots; }
+      
+      bool contains(Node* root) const {
+        if (!_dense) {
+          return _sparse.find(root->_id) != _sparse.end();
+        }
+        return root->_id - _offset < _indices.size() &&
+               _indices[root->_id - _offset] != NONE;
+      }
+      
+      inline uint32_t at(Node* root) const {
+        if (!_dense) {
+          auto it = _sparse.find(root->_id);
+          if (it == _sparse.end()) {
+            throw_error(Error, "Node " << root->_id << " is not the root of an indexed class");
+          }
+          return it->second;
+        } else if (!contains(root)) {
+          throw_error(Error, "Node " << root->_id << " is not the root of an indexed class");
+        }
+        return _indices[root->_id - _offset];
+      }
+    };
+    
+    // Mapping from root nodes to costs
+    class Costs {
+    private:
+      friend EGraph;
+      
+      // Costs are indexed by class index if index is set and by the
+      // id of the root node otherwise.
+      const ClassIndex* _index = nullptr;
+      std::vector<Cost> _costs;
+      
+      inline size_t slot(Node* root) const {
+        if (_index != nullptr) {
+          return _index->at(root);
+        } else if (root->_up != nullptr || root->_id >= _costs.size()) {
+          throw_error(Error, "Node " << root->_id << " is not the root of an indexed class");
+        }
+        return root->_id;
+      }
+      
+      inline bool contains(Node* root) const {
+        if (_index != nullptr) {
+          return _index->contains(root);
+        }
+        return root->_up == nullptr && root->_id < _costs.size();
+      }
+      
+      void resize(size_t node_count) {
+        assert(_index == nullptr);
+        _costs.resize(node_count, Cost::inf());
+      }
+    public:
+      Costs() {}
+      explicit Costs(const ClassIndex& index):
+        _index(&index), _costs(index.size(), Cost::inf()) {}
+      
+      inline size_t size() const { return _costs.size(); }
+      
+      inline Cost& at(Node* root) { return _costs[slot(root)]; }
+      inline const Cost& at(Node* root) const { return _costs[slot(root)]; }
+      
+      // Access by class index
+      inline Cost& operator[](size_t index) { return _costs[index]; }
+      inline const Cost& operator[](size_t index) const { return _costs[index]; }
+    };
+    
+    // Cost function for individual nodes.
+    // The resulting cost must be greater than 0 and greater than
+    // the cost of every child of the node.
+    using CostFn = std::function<Cost(Node* node, const Costs& costs)>;
+    
+    // Cost function for node data.
+    // Must return a cost greater than 0.
+    using DataCostFn = std::function<Cost(const NodeData&)>;
+    
+    // Mapping from root nodes to the extracted representatives
+    // from their equivalence class.
+    class Extracted {
+    private:
+      friend EGraph;
+      
+      ClassIndex _index;
+      std::vector<Node*> _nodes;
+    public:
+      Extracted() {}
+      explicit Extracted(ClassIndex&& index):
+        _index(std::move(index)), _nodes(_index.roots()) {}
+      
+      const ClassIndex& index() const { return _index; }
+      inline size_t size() const { return _nodes.size(); }
+      
+      bool contains(Node* root) const { return _index.contains(root); }
+      
+      inline Node*& at(Node* root) { return _nodes[_index.at(root)]; }
+      inline Node* at(Node* root) const { return _nodes[_index.at(root)]; }
+      
+      // Access by class index
+      inline Node*& operator[](size_t index) { return _nodes[index]; }
+      inline Node* operator[](size_t index) const { return _nodes[index]; }
+      
+      // Iterates over (root, node) pairs, like the std::unordered_map
+      // which was previously used to store extraction results.
+      class Iterator {
+      public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = std::pair<Node*, Node*>;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const value_type*;
+        using reference = const value_type&;
+      private:
+        const Extracted* _extracted = nullptr;
+        size_t _index = 0;
+        value_type _value;
+        
+        void load() {
+          if (_index < _extracted->size()) {
+            _value = value_type(_extracted->_index.root(_index), _extracted->_nodes[_index]);
+          }
+        }
+      public:
+        Iterator(const Extracted* extracted, size_t index):
+            _extracted(extracted), _index(index) {
+          load();
+        }
+        
+        Iterator& operator++() {
+          _index++;
+          load();
+          return *this;
+        }
+        
+        bool operator==(const Iterator& other) const { return _index == other._index; }
+        bool operator!=(const Iterator& other) const { return !(*this == other); }
+        reference operator*() const { return _value; }
+        pointer operator->() const { return &_value; }
+      };
+      
+      using iterator = Iterator;
+      using const_iterator = Iterator;
+      
+      Iterator begin() const { return Iterator(this, 0); }
+      Iterator end() const { return Iterator(this, size()); }
+      
+      Iterator find(Node* root) const {
+        return contains(root) ? Iterator(this, _index.at(root)) : end();
+      }
+      
+      size_t count(Node* root) const { return contains(root) ? 1 : 0; }
+    };
+    
+    // Data cost function which assigns the same cost to every node,
+    // so that the smallest terms are extracted
+    struct UnitCost {
+      Cost operator()(const NodeData& data) const { return Cost(1); }
+    };
+    
+  private:
+    // Among nodes of equal cost, all extractors choose the node with the
+    // lowest id, so that their results do not depend on the order in
+    // which nodes are visited.
+    static inline bool is_better(Cost cost, Node* node, Cost best, Node* best_node) {
+      return cost < best || (cost == best && !cost.is_inf() && node->_id < best_node->_id);
+    }
+    
+    // Evaluates a node or data cost function (see CostFn and DataCostFn)
+    template <class CostFnT>
+    static inline Cost node_cost(CostFnT& cost_fn, Node* node, const Costs& costs) {
+      if constexpr (std::is_invocable_r_v<Cost, CostFnT&, Node*, const Costs&>) {
+        return cost_fn(node, costs);
+      } else {
+        static_assert(std::is_invocable_r_v<Cost, CostFnT&, const NodeData&>,
+                      "Cost function must be a node or data cost function");
+        Cost cost = cost_fn(node->data());
+        for (Node* child : *node) {
+          cost += costs.at(child);
+        }
+        return cost;
+      }
+    }
+    
+    struct ExtractionItem {
+      Node* root = nullptr;
+      uint32_t slot = 0;
+      Cost cost;
+      
+      ExtractionItem(Node* _root, uint32_t _slot, Cost _cost):
+        root(_root), slot(_slot), cost(_cost) {}
+      
+      bool operator<(const ExtractionItem& other) const {
+        return cost > other.cost;
+      }
+    };
+    
+    using ExtractionQueue = std::priority_queue<ExtractionItem>;
+    
+    // Dijkstra's algorithm: Lowers the costs of the users of the queued
+    // classes until no cost decreases. Only classes contained in costs
+    // are visited.
+    template <class CostFnT>
+    static void relax(ExtractionQueue& queue,
+                      Costs& costs,
+                      std::vector<Node*>& extracted,
+                      CostFnT& cost_fn) {
+      while (!queue.empty()) {
+        ExtractionItem item = queue.top();
+        queue.pop();
+        
+        if (item.cost != costs[item.slot]) {
+          // Already found a lower cost representative for this equivalence class
+          continue;
+        }
+        
+        Node* item_root = item.root;
+        if (item_root->_uses != nullptr) {
+          Use* use = item_root->_uses;
+          while (true) {
+            Node* node = use->node();
+            Node* root = node->root();
+            if (node->is_in_hashcons() && costs.contains(root)) {
+              Cost cost = node_cost(cost_fn, node, costs);
+              assert(cost > item.cost);
+              uint32_t slot = uint32_t(costs.slot(root));
+              if (cost < costs[slot]) {
+                queue.push(ExtractionItem(root, slot, cost));
+                extracted[slot] = node;
+                costs[slot] = cost;
+              } else if (is_better(cost, node, costs[slot], extracted[slot])) {
+                extracted[slot] = node;
+              }
+            }
+            
+            if (use->next == item_root->_uses) {
+              break;
+            }
+            use = use->next;
+          }
+        }
+      }
+    }
+    
+    template <class CostFnT>
+    Extracted extract_classes(ClassIndex&& class_index, CostFnT& cost_fn) {
+      // Extraction is performed using dijkstra's algorithm
+      // Starting at the leaf nodes, increasingly high cost nodes
+      // are reached.
+      
+      Extracted extracted(std::move(class_index));
+      const ClassIndex& index = extracted.index();
+      Costs costs(index);
+      ExtractionQueue queue;
+      
+      // Insert leaf nodes
+      for (uint32_t it = 0; it < index.size(); it++) {
+        for (Node* node : index.root(it)->e_class()) {
+          if (node->size() == 0) {
+            Cost cost = node_cost(cost_fn, node, costs);
+            if (cost < costs[it]) {
+              queue.push(ExtractionItem(index.root(it), it, cost));
+              extracted[it] = node;
+              costs[it] = cost;
+            } else if (is_better(cost, node, costs[it], extracted[it])) {
+              extracted[it] = node;
+            }
+          }
+        }
+      }
+      
+      relax(queue, costs, extracted._nodes, cost_fn);
+      return extracted;
+    }
+    
+    // Root nodes of all equivalence classes reachable from root,
+    // sorted by id
+    std::vector<Node*> cone(Node* root) {
+      std::vector<Node*> roots;
+      std::unordered_set<Node*> visited;
+      std::vector<Node*> stack;
+      
+      root = root->root();
+      visited.insert(root);
+      stack.push_back(root);
+      while (!stack.empty()) {
+        Node* current = stack.back();
+        stack.pop_back();
+        roots.push_back(current);
+        
+        for (Node* node : current->e_class()) {
+          for (Node* child : *node) {
+            Node* child_root = child->root();
+            if (visited.insert(child_root).second) {
+              stack.push_back(child_root);
+            }
+          }
+        }
+      }
+      
+      std::sort(roots.begin(), roots.end(), [](Node* a, Node* b){
+        return a->_id < b->_id;
+      });
+      return roots;
+    }
+    
+  public:
+    // Extracts the cheapest representative of every equivalence class.
+    // The cost function is either a node cost function (see CostFn) or
+    // a data cost function (see DataCostFn). Any callable is accepted,
+    // so that the cost computation can be inlined.
+    template <class CostFnT>
+    Extracted extract(CostFnT&& cost_fn) {
+      return extract_classes(ClassIndex(_nodes), cost_fn);
+    }
+    
+    // Extracts the smallest representative of every equivalence class
+    Extracted extract() {
+      return extract(UnitCost());
+    }
+    
+    // Only extracts the equivalence classes reachable from root.
+    // The work is proportional to the size of the reachable subgraph
+    // instead of the entire e-graph.
+    template <class CostFnT>
+    Extracted extract(Node* root, CostFnT&& cost_fn) {
+      return extract_classes(ClassIndex(cone(root)), cost_fn);
+    }
+    
+    Extracted extract(Node* root) {
+      return extract(root, UnitCost());
+    }
+    
+    // Parallel version of extract. Costs are computed by Jacobi
+    // iteration (Bellman-Ford): Each round re-evaluates all classes
+    // whose children changed in the previous round, in parallel and
+    // using only the costs of the previous round, until no cost
+    // changes. Requires a cost function which is monotone in the costs
+    // of the children. Returns the same result as extract.
+    template <class CostFnT>
+    Extracted extract(ThreadPool& pool, CostFnT&& cost_fn) {
+      static constexpr size_t CHUNK_SIZE = 256;
+      
+      Extracted extracted{ClassIndex(_nodes)};
+      const ClassIndex& index = extracted.index();
+      Costs costs(index);
+      std::vector<Cost> next_costs(index.size());
+      std::vector<Node*> next_extracted(index.size());
+      
+      // Per thread lists of changed classes and their users
+      std::vector<std::vector<uint32_t>> changed(pool.size());
+      std::vector<std::vector<uint32_t>> users(pool.size());
+      
+      std::vector<uint32_t> active(index.size());
+      for (uint32_t it = 0; it < index.size(); it++) {
+        active[it] = it;
+      }
+      std::vector<uint8_t> queued(index.size(), 0);
+      
+      while (!active.empty()) {
+        size_t chunk_count = (active.size() + CHUNK_SIZE - 1) / CHUNK_SIZE;
+        pool.parallel_for(chunk_count, [&](size_t chunk, size_t thread){
+          size_t end = std::min(active.size(), (chunk + 1) * CHUNK_SIZE);
+          for (size_t it = chunk * CHUNK_SIZE; it < end; it++) {
+            uint32_t class_index = active[it];
+            Node* root = index.root(class_index);
+            
+            Cost best = Cost::inf();
+            Node* best_node = root;
+            for (Node* node : root->e_class().read_only()) {
+              Cost cost = node_cost(cost_fn, node, costs);
+              if (is_better(cost, node, best, best_node)) {
+                best = cost;
+                best_node = node;
+              }
+            }
+            
+            if (best != costs[class_index] || best_node != extracted[class_index]) {
+              next_costs[class_index] = best;
+              next_extracted[class_index] = best_node;
+              changed[thread].push_back(class_index);
+              if (best != costs[class_index]) {
+                for_each_user_of(root, [&](Node* user){
+                  users[thread].push_back(index.at(user->find()));
+                });
+              }
+            }
+          }
+        });
+        
+        for (std::vector<uint32_t>& buffer : changed) {
+          for (uint32_t class_index : buffer) {
+            costs[class_index] = next_costs[class_index];
+            extracted[class_index] = next_extracted[class_index];
+          }
+          buffer.clear();
+        }
+        
+        active.clear();
+        for (std::vector<uint32_t>& buffer : users) {
+          for (uint32_t class_index : buffer) {
+            if (!queued[class_index]) {
+              queued[class_index] = 1;
+              active.push_back(class_index);
+            }
+          }
+          buffer.clear();
+        }
+        for (uint32_t class_index : active) {
+          queued[class_index] = 0;
+        }
+      }
+      
+      return extracted;
+    }
+    
+    Extracted extract(ThreadPool& pool) {
+      return extract(pool, UnitCost());
+    }
+    
+    // Keeps the cheapest representatives of all equivalence classes up
+    // to date while the e-graph changes. update only re-evaluates the
+    // classes which changed since the previous update and their users,
+    // and propagates decreased costs to further users. Since costs
+    // never increase when nodes are added or classes are merged, the
+    // result is the same as that of extract.
+    template <class CostFnT = UnitCost>
+    class Extractor {
+    private:
+      CostFnT _cost_fn;
+      uint64_t _epoch = 0;
+      
+      // Costs and representatives by the id of the root node
+      Costs _costs;
+      std::vector<Node*> _extracted;
+      
+      // Re-evaluates all nodes in the class of root.
+      // Returns true if the cost of the class decreased.
+      bool evaluate(Node* root) {
+        Cost& cost = _costs[root->_id];
+        Node*& extracted = _extracted[root->_id];
+        Cost previous = cost;
+        
+        // The representative may have been evicted from the hashcons by
+        // rebuild, which does not canonicalize its children
+        if (extracted->size() > 0 && !extracted->is_in_hashcons()) {
+          cost = Cost::inf();
+          extracted = root;
+        }
+        
+        for (Node* node : root->e_class()) {
+          Cost node_cost = EGraph::node_cost(_cost_fn, node, _costs);
+          if (is_better(node_cost, node, cost, extracted)) {
+            cost = node_cost;
+            extracted = node;
+          }
+        }
+        
+        return cost < previous;
+      }
+    public:
+      Extractor() {}
+      explicit Extractor(const CostFnT& cost_fn): _cost_fn(cost_fn) {}
+      
+      // Updates the extraction after the e-graph changed.
+      // The e-graph must be clean (see rebuild).
+      void update(EGraph& e_graph) {
+        size_t node_count = e_graph.node_count();
+        size_t previous_count = _extracted.size();
+        _costs.resize(node_count);
+        _extracted.resize(node_count);
+        for (size_t id = previous_count; id < node_count; id++) {
+          _extracted[id] = e_graph.node_by_id(uint32_t(id));
+        }
+        
+        // Changed classes contain new nodes or merged classes. Their
+        // users may contain nodes with merged children.
+        ExtractionQueue queue;
+        e_graph.changed_since(_epoch, 1, [&](Node* root){
+          if (evaluate(root)) {
+            queue.push(ExtractionItem(root, root->_id, _costs[root->_id]));
+          }
+        });
+        relax(queue, _costs, _extracted, _cost_fn);
+        
+        _epoch = e_graph.epoch();
+      }
       
-      #define cmp(op) \
-        inline bool operator op(const Cost& other) const { \
-          return _value op other._value; \
+      // Epoch of the e-graph at the last update
+      uint64_t epoch() const { return _epoch; }
+      
+      Cost cost(Node* node) const { return _costs.at(node->find()); }
+      Node* at(Node* node) const { return _extracted[_costs.slot(node->find())]; }
+      
+      // Copies the current representatives of all equivalence classes
+      Extracted extracted(EGraph& e_graph) const {
+        Extracted extracted{ClassIndex(e_graph._nodes)};
+        for (size_t it = 0; it < extracted.size(); it++) {
+          extracted[it] = _extracted[extracted.index().root(it)->_id];
         }
+        return extracted;
+      }
+    };
+    
+  private:
+    // State of DAG cost extraction over a cone of equivalence classes.
+    // Classes and their candidate nodes are flattened into arrays
+    // indexed by class index and candidate index.
+    class DagExtraction {
+    private:
+      using Clock = std::chrono::steady_clock;
+      static constexpr uint32_t NONE = ~uint32_t(0);
       
-      cmp(==)
-      cmp(!=)
-      cmp(<=)
-      cmp(<)
-      cmp(>=)
-      cmp(>)
+      // Maximum total capacity of the class sets of greedy_shared,
+      // which limits them to about 128 MB
+      static constexpr size_t MAX_SET_ENTRIES = size_t(1) << 23;
       
-      #undef cmp
+      struct Candidate {
+        Node* node = nullptr;
+        Cost cost;
+        uint32_t first_child = 0;
+        uint32_t child_count = 0;
+      };
+      
+      const ClassIndex& _index;
+      uint32_t _root = 0;
+      
+      // Candidates of class c are _candidates[_first[c]] ... _candidates[_first[c + 1] - 1]
+      std::vector<uint32_t> _first;
+      std::vector<Candidate> _candidates;
+      std::vector<uint32_t> _children;
+      
+      // Candidates using each class, flattened in the same way
+      std::vector<uint32_t> _first_user;
+      std::vector<uint32_t> _users;
+      
+      // Class owning each candidate
+      std::vector<uint32_t> _owner;
+      
+      // Cheapest candidate cost of every class, used as lower bound
+      std::vector<Cost> _min_cost;
+      
+      // Current selection and its DAG cost
+      std::vector<uint32_t> _choice;
+      Cost _cost = Cost::inf();
+      
+      // Refinement: Number of selected nodes of reachable classes using
+      // each class, and the changes made by the current move
+      std::vector<uint32_t> _refs;
+      std::vector<uint32_t> _acquired;
+      std::vector<uint32_t> _released;
+      std::vector<uint32_t> _stack;
+      std::vector<uint32_t> _visited;
+      uint32_t _epoch = 0;
+      size_t _work = 0;
+      size_t _work_limit = ~size_t(0);
+      
+      // Branch and bound
+      Clock::time_point _deadline;
+      bool _timed_out = false;
+      size_t _steps = 0;
+      std::vector<uint32_t> _assigned;
+      std::vector<bool> _in_frontier;
+      std::vector<uint32_t> _frontier;
+      
+      // Computes the DAG cost of a selection. Returns infinity if the
+      // selection is incomplete or cyclic.
+      Cost dag_cost(const std::vector<uint32_t>& choice) const {
+        std::vector<uint8_t> state(_index.size(), 0);
+        std::vector<std::pair<uint32_t, uint32_t>> stack;
+        Cost cost = 0;
+        
+        stack.emplace_back(_root, 0);
+        state[_root] = 1;
+        while (!stack.empty()) {
+          auto& [index, child] = stack.back();
+          if (choice[index] == NONE) {
+            return Cost::inf();
+          }
+          const Candidate& candidate = _candidates[choice[index]];
+          if (child == 0) {
+            cost += candidate.cost;
+          }
+          if (child < candidate.child_count) {
+            uint32_t child_index = _children[candidate.first_child + child];
+            child++;
+            if (state[child_index] == 1) {
+              return Cost::inf();
+            } else if (state[child_index] == 0) {
+              state[child_index] = 1;
+              stack.emplace_back(child_index, 0);
+            }
+          } else {
+            state[index] = 2;
+            stack.pop_back();
+          }
+        }
+        
+        return cost;
+      }
+      
+      // Classes reachable from the root in the current selection
+      std::vector<uint32_t> selected() const {
+        std::vector<bool> visited(_index.size(), false);
+        std::vector<uint32_t> classes;
+        visited[_root] = true;
+        classes.push_back(_root);
+        for (size_t it = 0; it < classes.size(); it++) {
+          const Candidate& candidate = _candidates[_choice[classes[it]]];
+          for (uint32_t child = 0; child < candidate.child_count; child++) {
+            uint32_t index = _children[candidate.first_child + child];
+            if (!visited[index]) {
+              visited[index] = true;
+              classes.push_back(index);
+            }
+          }
+        }
+        return classes;
+      }
+      
+      bool check_deadline() {
+        if (++_steps % 1024 == 0 && Clock::now() > _deadline) {
+          _timed_out = true;
+        }
+        return _timed_out;
+      }
+      
+      void search(Cost cost, Cost bound) {
+        if (check_deadline() || cost + bound >= _cost) {
+          return;
+        }
+        
+        if (_frontier.empty()) {
+          // All reachable classes are assigned, but the assignment may
+          // still contain cycles through shared classes.
+          Cost total = dag_cost(_assigned);
+          if (total < _cost) {
+            _cost = total;
+            for (uint32_t index = 0; index < _index.size(); index++) {
+              if (_assigned[index] != NONE) {
+                _choice[index] = _assigned[index];
+              }
+            }
+          }
+          return;
+        }
+        
+        uint32_t index = _frontier.back();
+        _frontier.pop_back();
+        _in_frontier[index] = false;
+        bound = Cost(bound.value() - _min_cost[index].value());
+        
+        for (uint32_t it = _first[index]; it < _first[index + 1]; it++) {
+          const Candidate& candidate = _candidates[it];
+          _assigned[index] = it;
+          
+          size_t frontier_size = _frontier.size();
+          Cost child_bound = bound;
+          bool valid = true;
+          for (uint32_t child = 0; child < candidate.child_count; child++) {
+            uint32_t child_index = _children[candidate.first_child + child];
+            if (child_index == index || _min_cost[child_index].is_inf()) {
+              valid = false;
+              break;
+            }
+            if (_assigned[child_index] == NONE && !_in_frontier[child_index]) {
+              _in_frontier[child_index] = true;
+              _frontier.push_back(child_index);
+              child_bound += _min_cost[child_index];
+            }
+          }
+          
+          if (valid) {
+            search(cost + candidate.cost, child_bound);
+          }
+          
+          while (_frontier.size() > frontier_size) {
+            _in_frontier[_frontier.back()] = false;
+            _frontier.pop_back();
+          }
+          _assigned[index] = NONE;
+        }
+        
+        _frontier.push_back(index);
+        _in_frontier[index] = true;
+      }
+      
+      // Evaluates every class with evaluate(index) until no selection
+      // changes. evaluate returns true if the selection of the class
+      // changed, in which case the classes using it are evaluated again.
+      template <class Fn>
+      void propagate(Fn evaluate) {
+        std::deque<uint32_t> queue;
+        std::vector<bool> queued(_index.size(), true);
+        for (uint32_t it = 0; it < _index.size(); it++) {
+          queue.push_back(it);
+        }
+        
+        while (!queue.empty()) {
+          uint32_t index = queue.front();
+          queue.pop_front();
+          queued[index] = false;
+          
+          if (evaluate(index)) {
+            for (uint32_t it = _first_user[index]; it < _first_user[index + 1]; it++) {
+              uint32_t user = _owner[_users[it]];
+              if (!queued[user]) {
+                queued[user] = true;
+                queue.push_back(user);
+              }
+            }
+          }
+        }
+      }
+      
+      // Greedy selection which tracks the set of classes in the currently
+      // selected term of every class together with their costs, so that
+      // classes shared by multiple children are only counted once.
+      // Returns false if the sets exceed MAX_SET_ENTRIES in total, since
+      // they may grow quadratically in the number of classes.
+      bool greedy_shared() {
+        using CostSet = std::vector<std::pair<uint32_t, Cost>>;
+        std::vector<CostSet> sets(_index.size());
+        std::vector<Cost> totals(_index.size(), Cost::inf());
+        size_t entries = 0;
+        
+        CostSet set;
+        CostSet merged;
+        propagate([&](uint32_t index){
+          if (entries > MAX_SET_ENTRIES) {
+            return false;
+          }
+          
+          bool changed = false;
+          for (uint32_t it = _first[index]; it < _first[index + 1]; it++) {
+            const Candidate& candidate = _candidates[it];
+            
+            // Terms containing their own class are cyclic
+            bool valid = true;
+            for (uint32_t child = 0; child < candidate.child_count && valid; child++) {
+              const CostSet& child_set = sets[_children[candidate.first_child + child]];
+              auto found = std::lower_bound(
+                child_set.begin(), child_set.end(), index,
+                [](const auto& a, uint32_t b){ return a.first < b; }
+              );
+              valid = !child_set.empty() &&
+                      (found == child_set.end() || found->first != index);
+            }
+            if (!valid) {
+              continue;
+            }
+            
+            set.clear();
+            set.emplace_back(index, candidate.cost);
+            for (uint32_t child = 0; child < candidate.child_count; child++) {
+              const CostSet& child_set = sets[_children[candidate.first_child + child]];
+              merged.clear();
+              std::set_union(
+                set.begin(), set.end(),
+                child_set.begin(), child_set.end(),
+                std::back_inserter(merged),
+                [](const auto& a, const auto& b){ return a.first < b.first; }
+              );
+              std::swap(set, merged);
+            }
+            
+            Cost total = 0;
+            for (const auto& [class_index, cost] : set) {
+              total += cost;
+            }
+            
+            if (total < totals[index]) {
+              size_t capacity = sets[index].capacity();
+              totals[index] = total;
+              sets[index] = set;
+              entries = entries + sets[index].capacity() - capacity;
+              _choice[index] = it;
+              changed = true;
+            }
+          }
+          return changed;
+        });
+        
+        return entries <= MAX_SET_ENTRIES;
+      }
+      
+      // Greedy selection which minimizes the tree cost of every class.
+      // Ties are broken like in extract, so that the selection matches
+      // the one of extract.
+      void greedy_tree() {
+        std::vector<Cost> totals(_index.size(), Cost::inf());
+        propagate([&](uint32_t index){
+          bool changed = false;
+          for (uint32_t it = _first[index]; it < _first[index + 1]; it++) {
+            const Candidate& candidate = _candidates[it];
+            Cost total = candidate.cost;
+            for (uint32_t child = 0; child < candidate.child_count; child++) {
+              total += totals[_children[candidate.first_child + child]];
+            }
+            Node* best = _choice[index] == NONE ? nullptr : _candidates[_choice[index]].node;
+            if (is_better(total, candidate.node, totals[index], best)) {
+              totals[index] = total;
+              _choice[index] = it;
+              changed = true;
+            }
+          }
+          return changed;
+        });
+      }
+      
+      // Adds the children of candidate to the selection. The costs of
+      // classes which become reachable are added to cost.
+      void acquire(uint32_t candidate, Cost& cost) {
+        _stack.push_back(candidate);
+        while (!_stack.empty()) {
+          const Candidate& current = _candidates[_stack.back()];
+          _stack.pop_back();
+          for (uint32_t child = 0; child < current.child_count; child++) {
+            uint32_t index = _children[current.first_child + child];
+            _acquired.push_back(index);
+            if (_refs[index]++ == 0) {
+              cost += _candidates[_choice[index]].cost;
+              _stack.push_back(_choice[index]);
+            }
+          }
+          _work += current.child_count + 1;
+        }
+      }
+      
+      // Removes the children of candidate from the selection. The costs
+      // of classes which are no longer reachable are added to cost.
+      void release(uint32_t candidate, Cost& cost) {
+        _stack.push_back(candidate);
+        while (!_stack.empty()) {
+          const Candidate& current = _candidates[_stack.back()];
+          _stack.pop_back();
+          for (uint32_t child = 0; child < current.child_count; child++) {
+            uint32_t index = _children[current.first_child + child];
+            _released.push_back(index);
+            if (--_refs[index] == 0) {
+              cost += _candidates[_choice[index]].cost;
+              _stack.push_back(_choice[index]);
+            }
+          }
+          _work += current.child_count + 1;
+        }
+      }
+      
+      // Checks whether selecting candidate for its class results in a
+      // complete and acyclic selection
+      bool can_select(uint32_t candidate) {
+        uint32_t target = _owner[candidate];
+        if (++_epoch == 0) {
+          std::fill(_visited.begin(), _visited.end(), 0);
+          _epoch = 1;
+        }
+        
+        bool valid = true;
+        _stack.push_back(candidate);
+        while (!_stack.empty()) {
+          const Candidate& current = _candidates[_stack.back()];
+          _stack.pop_back();
+          for (uint32_t child = 0; child < current.child_count && valid; child++) {
+            uint32_t index = _children[current.first_child + child];
+            if (index == target || _choice[index] == NONE) {
+              valid = false;
+            } else if (_visited[index] != _epoch) {
+              _visited[index] = _epoch;
+              _stack.push_back(_choice[index]);
+            }
+          }
+          _work += current.child_count + 1;
+        }
+        _stack.clear();
+        return valid;
+      }
+      
+      // Selects candidate for its class if this decreases the DAG cost.
+      // Only the classes entering or leaving the selection are visited.
+      bool try_select(uint32_t candidate) {
+        uint32_t index = _owner[candidate];
+        if (!can_select(candidate)) {
+          return false;
+        }
+        
+        // Acquiring first ensures that classes shared by both terms
+        // are never released
+        Cost added = _candidates[candidate].cost;
+        Cost removed = _candidates[_choice[index]].cost;
+        _acquired.clear();
+        _released.clear();
+        acquire(candidate, added);
+        release(_choice[index], removed);
+        
+        if (added < removed) {
+          _choice[index] = candidate;
+          _cost = Cost(_cost.value() - removed.value() + added.value());
+          return true;
+        }
+        
+        for (uint32_t child : _acquired) {
+          _refs[child]--;
+        }
+        for (uint32_t child : _released) {
+          _refs[child]++;
+        }
+        return false;
+      }
+    public:
+      template <class DataCostFnT>
+      DagExtraction(const ClassIndex& index, Node* root, DataCostFnT& data_cost):
+          _index(index),
+          _root(index.at(root)),
+          _min_cost(index.size(), Cost::inf()),
+          _choice(index.size(), NONE) {
+        
+        _first.reserve(index.size() + 1);
+        std::vector<uint32_t> use_counts(index.size() + 1, 0);
+        for (Node* class_root : index.roots()) {
+          _first.push_back(uint32_t(_candidates.size()));
+          for (Node* node : class_root->e_class()) {
+            Candidate candidate;
+            candidate.node = node;
+            candidate.cost = data_cost(node->data());
+            candidate.first_child = uint32_t(_children.size());
+            candidate.child_count = uint32_t(node->size());
+            for (Node* child : *node) {
+              uint32_t child_index = index.at(child);
+              _children.push_back(child_index);
+              use_counts[child_index]++;
+            }
+            _candidates.push_back(candidate);
+            _owner.push_back(uint32_t(_first.size() - 1));
+          }
+        }
+        _first.push_back(uint32_t(_candidates.size()));
+        
+        _first_user.resize(index.size() + 1, 0);
+        for (uint32_t it = 0; it < index.size(); it++) {
+          _first_user[it + 1] = _first_user[it] + use_counts[it];
+        }
+        _users.resize(_first_user.back());
+        std::vector<uint32_t> offsets(_first_user.begin(), _first_user.end() - 1);
+        for (uint32_t it = 0; it < _candidates.size(); it++) {
+          const Candidate& candidate = _candidates[it];
+          for (uint32_t child = 0; child < candidate.child_count; child++) {
+            _users[offsets[_children[candidate.first_child + child]]++] = it;
+          }
+        }
+        
+        for (uint32_t it = 0; it < _candidates.size(); it++) {
+          Cost& min_cost = _min_cost[_owner[it]];
+          if (_candidates[it].cost < min_cost) {
+            min_cost = _candidates[it].cost;
+          }
+        }
+      }
+      
+      // Bottom up greedy selection. Selects the better of a selection
+      // which only counts shared classes once and a selection which
+      // minimizes the tree cost of every class, so that the result is
+      // never worse than the term found by extract. The shared
+      // selection is skipped if its class sets become too large.
+      void greedy() {
+        std::vector<uint32_t> shared;
+        Cost shared_cost = Cost::inf();
+        if (greedy_shared()) {
+          shared_cost = dag_cost(_choice);
+          shared = _choice;
+        }
+        
+        _choice.assign(_index.size(), NONE);
+        greedy_tree();
+        _cost = dag_cost(_choice);
+        if (!shared.empty() && shared_cost <= _cost) {
+          _choice = std::move(shared);
+          _cost = shared_cost;
+        }
+      }
+      
+      // Local search: Replaces the selected node of a single class
+      // as long as this decreases the DAG cost. Stops at the deadline
+      // or once the work limit is exceeded.
+      void refine() {
+        if (_cost.is_inf()) {
+          return;
+        }
+        
+        _refs.assign(_index.size(), 0);
+        _visited.assign(_index.size(), 0);
+        _epoch = 0;
+        _refs[_root] = 1;
+        Cost cost = 0;
+        acquire(_choice[_root], cost);
+        
+        bool changed = true;
+        while (changed) {
+          changed = false;
+          for (uint32_t index : selected()) {
+            for (uint32_t it = _first[index]; it < _first[index + 1]; it++) {
+              // Earlier moves may have removed the class from the selection
+              if (_refs[index] == 0) {
+                break;
+              }
+              if (it != _choice[index] && try_select(it)) {
+                changed = true;
+              }
+              if (check_deadline() || _work > _work_limit) {
+                return;
+              }
+            }
+          }
+        }
+      }
+      
+      // Exact branch and bound search, starting from the current
+      // selection as upper bound. Stops at the deadline.
+      void branch_and_bound() {
+        _assigned.assign(_index.size(), NONE);
+        _in_frontier.assign(_index.size(), false);
+        _frontier.clear();
+        
+        _frontier.push_back(_root);
+        _in_frontier[_root] = true;
+        if (!_min_cost[_root].is_inf()) {
+          search(0, _min_cost[_root]);
+        }
+      }
+      
+      void set_deadline(const Clock::time_point& deadline) { _deadline = deadline; }
+      void set_work_limit(size_t work_limit) { _work_limit = work_limit; }
+      size_t problem_size() const { return _candidates.size() + _children.size(); }
+      bool timed_out() const { return _timed_out; }
+      Cost cost() const { return _cost; }
+      
+      Extracted extracted(const ClassIndex& index) const {
+        Extracted extracted{ClassIndex(index)};
+        for (uint32_t it = 0; it < index.size(); it++) {
+          if (_choice[it] != NONE) {
+            extracted[it] = _candidates[_choice[it]].node;
+          }
+        }
+        return extracted;
+      }
     };
     
-    // Mapping from root nodes to costs
-    using Costs = std::unordered_map<Node*, Cost>;
+  public:
+    // Extracts the term of root with the lowest DAG cost. Unlike the tree
+    // cost minimized by extract, the DAG cost counts every equivalence
+    // class in the extracted term only once, no matter how often it is
+    // shared. data_cost is a data cost function (see DataCostFn).
+    // The result is found by a greedy selection which tracks shared
+    // classes, followed by local refinement. It is never worse than
+    // the term found by extract. If time_limit is greater
+    // than 0, an exact branch and bound search improves the result
+    // until it is optimal or time_limit seconds have passed. Otherwise
+    // the refinement is bounded by a work limit proportional to the
+    // size of the cone of root.
+    // Only classes reachable from root are extracted.
+    template <class DataCostFnT>
+    Extracted extract_dag(Node* root, DataCostFnT&& data_cost, double time_limit = 0.0) {
+      static_assert(std::is_invocable_r_v<Cost, DataCostFnT&, const NodeData&>,
+                    "DAG extraction requires a data cost function");
+      
+      ClassIndex index(cone(root));
+      DagExtraction extraction(index, root->root(), data_cost);
+      
+      auto deadline = std::chrono::steady_clock::now() +
+        std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+          std::chrono::duration<double>(time_limit)
+        );
+      if (time_limit > 0.0) {
+        extraction.set_deadline(deadline);
+      } else {
+        extraction.set_deadline(std::chrono::steady_clock::time_point::max());
+        extraction.set_work_limit(std::max(size_t(1) << 26, 64 * extraction.problem_size()));
+      }
+      
+      extraction.greedy();
+      extraction.refine();
+      if (time_limit > 0.0) {
+        extraction.branch_and_bound();
+      }
+      
+      return extraction.extracted(index);
+    }
     
-    // Cost function for individual nodes.
-    // The resulting cost must be greater than 0 and greater than
-    // the cost of every child of the node.
-    using CostFn = std::function<Cost(Node* node, const Costs& costs)>;
+    Extracted extract_dag(Node* root) {
+      return extract_dag(root, UnitCost());
+    }
     
-    // Cost function for node data.
-    // Must return a cost greater than 0.
-    using DataCostFn = std::function<Cost(const NodeData&)>;
+    // DAG cost of the term of root in extracted
+    template <class DataCostFnT>
+    Cost dag_cost(Node* root, const Extracted& extracted, DataCostFnT&& data_cost) {
+      std::unordered_set<Node*> visited;
+      std::vector<Node*> stack;
+      Cost cost = 0;
+      
+      root = root->root();
+      visited.insert(root);
+      stack.push_back(root);
+      while (!stack.empty()) {
+        Node* node = extracted.at(stack.back());
+        stack.pop_back();
+        cost += data_cost(node->data());
+        for (Node* child : *node) {
+          if (visited.insert(child).second) {
+            stack.push_back(child);
+          }
+        }
+      }
+      
+      return cost;
+    }
     
-    // Mapping from root nodes to the extracted representatives
-    // from their equivalence class.
-    using Extracted = std::unordered_map<Node*, Node*>;
+    // The k cheapest terms of equivalence classes, ranked by tree cost.
+    // A term is a node together with the rank of the term of each of
+    // its children.
+    class KBest {
+    private:
+      friend EGraph;
+      
+      struct Term {
+        Node* node = nullptr;
+        Cost cost;
+        uint32_t first_rank = 0;
+      };
+      
+      ClassIndex _index;
+      std::vector<std::vector<Term>> _terms;
+      std::vector<uint32_t> _ranks;
+      
+      const Term& term(Node* root, size_t rank) const {
+        const std::vector<Term>& terms = _terms[_index.at(root)];
+        if (rank >= terms.size()) {
+          throw_error(Error, "Only found " << terms.size() << " terms");
+        }
+        return terms[rank];
+      }
+    public:
+      KBest() {}
+      explicit KBest(ClassIndex&& index):
+        _index(std::move(index)), _terms(_index.size()) {}
+      
+      const ClassIndex& index() const { return _index; }
+      
+      // Number of terms found for the class of root
+      size_t count(Node* root) const { return _terms[_index.at(root)].size(); }
+      
+      Cost cost(Node* root, size_t rank) const { return term(root, rank).cost; }
+      Node* node(Node* root, size_t rank) const { return term(root, rank).node; }
+      
+      size_t child_rank(Node* root, size_t rank, size_t child) const {
+        const Term& term = this->term(root, rank);
+        if (child >= term.node->size()) {
+          throw_error(Error, "Node has no child " << child);
+        }
+        return _ranks[term.first_rank + child];
+      }
+      
+      // Writes the term as data(child0, child1, ...)
+      void write(std::ostream& stream, Node* root, size_t rank) const {
+        const Term& term = this->term(root, rank);
+        stream << term.node->data();
+        if (term.node->size() > 0) {
+          stream << "(";
+          for (size_t it = 0; it < term.node->size(); it++) {
+            if (it > 0) {
+              stream << ", ";
+            }
+            write(stream, term.node->at(it), _ranks[term.first_rank + it]);
+          }
+          stream << ")";
+        }
+      }
+    };
     
-    Extracted extract(const CostFn& cost_fn) {
-      // Extraction is performed using dijkstra's algorithm
-      // Starting at the leaf nodes, increasingly high cost nodes
-      // are reached.
+    // Extracts the k cheapest terms of root, where the cost of a term
+    // is the sum of the data costs of its nodes (see DataCostFn).
+    // Terms of all classes reachable from root are derived in order of
+    // increasing cost using a single priority queue (Knuth's
+    // generalization of Dijkstra's algorithm). Each derived term of a
+    // node only queues the terms of the same node with the rank of one
+    // child incremented (Huang and Chiang, "Better k-best Parsing"), so
+    // only O(k) terms are derived per class.
+    template <class DataCostFnT>
+    KBest extract_k_best(Node* root, size_t k, DataCostFnT&& data_cost) {
+      static_assert(std::is_invocable_r_v<Cost, DataCostFnT&, const NodeData&>,
+                    "k-best extraction requires a data cost function");
       
-      struct QueueItem {
+      KBest k_best{ClassIndex(cone(root))};
+      const ClassIndex& index = k_best.index();
+      
+      struct Edge {
         Node* node = nullptr;
+        uint32_t head = 0;
+        Cost cost;
+      };
+      
+      // Candidate term: A node with a rank for every child.
+      // Its successors only increment ranks at positions >= last,
+      // so that every candidate is queued at most once.
+      struct Candidate {
+        uint32_t edge = 0;
+        uint32_t first_rank = 0;
+        uint32_t last = 0;
+      };
+      
+      struct QueueItem {
         Cost cost;
+        uint32_t candidate = 0;
         
-        QueueItem(Node* _node, Cost _cost):
-          node(_node), cost(_cost) {}
+        QueueItem(Cost _cost, uint32_t _candidate):
+          cost(_cost), candidate(_candidate) {}
         
         bool operator<(const QueueItem& other) const {
           return cost > other.cost;
         }
       };
       
-      Extracted extracted;
-      Costs costs;
+      std::vector<Edge> edges;
+      for (uint32_t it = 0; it < index.size(); it++) {
+        for (Node* node : index.root(it)->e_class()) {
+          edges.push_back(Edge {node, it, data_cost(node->data())});
+        }
+      }
+      
+      std::vector<Candidate> candidates;
+      std::vector<uint32_t> ranks;
       std::priority_queue<QueueItem> queue;
       
-      for (Node* root : _roots) {
-        extracted.insert({root, root});
-        costs.insert({root, Cost::inf()});
-      }
+      // Candidates waiting for a term of a class, by class and rank.
+      // Ranks of children are at most k, since they are only
+      // incremented from ranks of existing terms.
+      std::vector<std::vector<std::vector<uint32_t>>> waiting(index.size());
       
-      // Insert leaf nodes
-      for (Node* root : _roots) {
-        for (Node* node : root->e_class()) {
-          if (node->size() == 0) {
-            Cost cost = cost_fn(node, costs);
-            if (cost < costs.at(root)) {
-              queue.push(QueueItem(root, cost));
-              extracted.at(root) = node;
-              costs.at(root) = cost;
+      auto push = [&](uint32_t id){
+        const Candidate& candidate = candidates[id];
+        const Edge& edge = edges[candidate.edge];
+        Cost cost = edge.cost;
+        for (size_t it = 0; it < edge.node->size(); it++) {
+          uint32_t child = index.at(edge.node->at(it));
+          uint32_t rank = ranks[candidate.first_rank + it];
+          const auto& terms = k_best._terms[child];
+          if (rank >= terms.size()) {
+            if (waiting[child].size() <= rank) {
+              waiting[child].resize(rank + 1);
             }
+            waiting[child][rank].push_back(id);
+            return;
           }
+          cost += terms[rank].cost;
         }
+        queue.push(QueueItem(cost, id));
+      };
+      
+      for (uint32_t it = 0; it < edges.size(); it++) {
+        candidates.push_back(Candidate {it, uint32_t(ranks.size()), 0});
+        ranks.resize(ranks.size() + edges[it].node->size(), 0);
+        push(it);
       }
       
-      while (!queue.empty()) {
+      uint32_t root_index = index.at(root->root());
+      std::vector<uint32_t> woken;
+      while (!queue.empty() && k_best._terms[root_index].size() < k) {
         QueueItem item = queue.top();
         queue.pop();
         
-        if (item.cost != costs.at(item.node)) {
-          // Already found a lower cost representative for this equivalence class
+        Candidate candidate = candidates[item.candidate];
+        const Edge& edge = edges[candidate.edge];
+        std::vector<typename KBest::Term>& terms = k_best._terms[edge.head];
+        if (terms.size() >= k) {
           continue;
         }
         
-        if (item.node->_uses != nullptr) {
-          Use* use = item.node->_uses;
-          while (true) {
-            Node* node = use->node;
-            if (node->is_in_hashcons()) {
-              Cost cost = cost_fn(node, costs);
-              assert(cost > item.cost);
-              Node* root = node->root();
-              if (cost < costs.at(root)) {
-                queue.push(QueueItem(root, cost));
-                extracted.at(root) = node;
-                costs.at(root) = cost;
-              }
-            }
-            
-            if (use->next == item.node->_uses) {
-              break;
-            }
-            use = use->next;
+        uint32_t rank = uint32_t(terms.size());
+        typename KBest::Term term;
+        term.node = edge.node;
+        term.cost = item.cost;
+        term.first_rank = uint32_t(k_best._ranks.size());
+        for (size_t it = 0; it < edge.node->size(); it++) {
+          k_best._ranks.push_back(ranks[candidate.first_rank + it]);
+        }
+        terms.push_back(term);
+        
+        // Wake candidates waiting for this term
+        if (rank < waiting[edge.head].size()) {
+          woken.clear();
+          std::swap(woken, waiting[edge.head][rank]);
+          for (uint32_t id : woken) {
+            push(id);
+          }
+        }
+        
+        // Queue successors
+        for (uint32_t child = candidate.last; child < edge.node->size(); child++) {
+          uint32_t id = uint32_t(candidates.size());
+          candidates.push_back(Candidate {candidate.edge, uint32_t(ranks.size()), child});
+          for (size_t it = 0; it < edge.node->size(); it++) {
+            ranks.push_back(ranks[candidate.first_rank + it] + (it == child));
           }
+          push(id);
         }
       }
       
-      return extracted;
-    }
-    
-    Extracted extract(const DataCostFn& data_cost) {
-      return extract([&](Node* node, const Costs& costs){
-        Cost cost = data_cost(node->data());
-        for (Node* child : *node) {
-          cost += costs.at(child);
-        }
-        return cost;
-      });
+      return k_best;
     }
     
-    Extracted extract() {
-      return extract([&](const NodeData& data){
-        return 1;
-      });
+    KBest extract_k_best(Node* root, size_t k) {
+      return extract_k_best(root, k, UnitCost());
     }
     
     void write_dot(std::ostream& stream) const {
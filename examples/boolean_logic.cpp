@@ -14,6 +14,7 @@
 
 #include <iostream>
 #include <variant>
+#include <optional>
 
 #include "../egraphs.hpp"
 
@@ -89,10 +90,66 @@ std::ostream& operator<<(std::ostream& stream, const NodeData& data) {
   return stream;
 }
 
+// Folds constants whenever nodes are created or classes are merged
+struct ConstantAnalysis {
+  using Data = std::optional<bool>;
+  
+  template <class EGraph>
+  Data make(EGraph& e_graph, typename EGraph::Node* node) {
+    switch (node->data().kind()) {
+      case NodeKind::Constant: return node->data().constant();
+      case NodeKind::Not: {
+        Data a = e_graph.analysis(node->at(0));
+        return a.has_value() ? Data(!a.value()) : Data();
+      }
+      case NodeKind::And: {
+        Data a = e_graph.analysis(node->at(0));
+        Data b = e_graph.analysis(node->at(1));
+        if (a == Data(false) || b == Data(false)) {
+          return false;
+        } else if (a.has_value() && b.has_value()) {
+          return true;
+        }
+        return {};
+      }
+      case NodeKind::Or: {
+        Data a = e_graph.analysis(node->at(0));
+        Data b = e_graph.analysis(node->at(1));
+        if (a == Data(true) || b == Data(true)) {
+          return true;
+        } else if (a.has_value() && b.has_value()) {
+          return false;
+        }
+        return {};
+      }
+      default: return {};
+    }
+  }
+  
+  bool join(Data& a, const Data& b) {
+    if (!a.has_value() && b.has_value()) {
+      a = b;
+      return true;
+    }
+    return false;
+  }
+  
+  template <class EGraph>
+  void modify(EGraph& e_graph, typename EGraph::Node* root, typename EGraph::MergeQueue& queue) {
+    Data value = e_graph.analysis(root);
+    if (value.has_value()) {
+      queue.merge(root, e_graph.node(value.value()));
+    }
+  }
+};
+
 int main() {
-  using EGraph = egraphs::EGraph<NodeKind, NodeData>;
+  using EGraph = egraphs::EGraph<NodeKind,
+                                 NodeData,
+                                 egraphs::ChainedHashcons,
+                                 egraphs::NodeHasher,
+                                 ConstantAnalysis>;
   using Node = EGraph::Node;
-  using EClass = EGraph::EClass;
   
   EGraph e_graph;
   
@@ -107,90 +164,75 @@ int main() {
   
   EGraph::MergeQueue queue;
   do {
-    for (Node* root : e_graph.roots()) {
-      for (Node* node : root->e_class()) {
-        switch (node->data().kind()) {
-          case NodeKind::Not:
-            for (Node* and_node : node->at(0)->e_class().match(NodeKind::And)) {
-              queue.merge(
-                node,
-                e_graph.node(NodeKind::Or, {
-                  e_graph.node(NodeKind::Not, {and_node->at(0)}),
-                  e_graph.node(NodeKind::Not, {and_node->at(1)})
-                })
-              );
-            }
-            for (Node* or_node : node->at(0)->e_class().match(NodeKind::Or)) {
-              queue.merge(
-                node,
-                e_graph.node(NodeKind::And, {
-                  e_graph.node(NodeKind::Not, {or_node->at(0)}),
-                  e_graph.node(NodeKind::Not, {or_node->at(1)})
-                })
-              );
-            }
-            for (Node* not_node : node->at(0)->e_class().match(NodeKind::Not)) {
-              queue.merge(
-                node,
-                not_node->at(0)
-              );
-            }
-            for (Node* constant_node : node->at(0)->e_class().match(NodeKind::Constant)) {
-              queue.merge(
-                node,
-                e_graph.node(!constant_node->data().constant())
-              );
-            }
-          break;
-          case NodeKind::And:
-            queue.merge(node, e_graph.node(NodeKind::And, {
-              node->at(1),
-              node->at(0)
-            }));
-            if (node->at(0)->e_class().match(NodeData(false)).not_empty()) {
-              queue.merge(node, e_graph.node(false));
-            }
-            if (node->at(0)->e_class().match(NodeData(true)).not_empty()) {
-              queue.merge(node, node->at(1));
-            }
-            if (node->at(0) == node->at(1)) {
-              queue.merge(node, node->at(0));
-            }
-            for (Node* not_node : node->at(0)->e_class().match(NodeKind::Not)) {
-              if (not_node->at(0) == node->at(1)) {
-                queue.merge(node, e_graph.node(false));
-              }
-            }
-          break;
-          case NodeKind::Or:
-            queue.merge(node, e_graph.node(NodeKind::Or, {
-              node->at(1),
-              node->at(0)
-            }));
-            if (node->at(0)->e_class().match(NodeData(true)).not_empty() ) {
-              queue.merge(node, e_graph.node(true));
-            }
-            if (node->at(0)->e_class().match(NodeData(false)).not_empty()) {
-              queue.merge(node, node->at(1));
-            }
-            if (node->at(0) == node->at(1)) {
-              queue.merge(node, node->at(0));
-            }
-            for (Node* not_node : node->at(0)->e_class().match(NodeKind::Not)) {
-              if (not_node->at(0) == node->at(1)) {
-                queue.merge(node, e_graph.node(true));
-              }
-            }
-          break;
+    for (Node* node : e_graph.nodes_of_kind(NodeKind::Not)) {
+      for (Node* and_node : node->at(0)->e_class().match(NodeKind::And)) {
+        queue.merge(
+          node,
+          e_graph.node(NodeKind::Or, {
+            e_graph.node(NodeKind::Not, {and_node->at(0)}),
+            e_graph.node(NodeKind::Not, {and_node->at(1)})
+          })
+        );
+      }
+      for (Node* or_node : node->at(0)->e_class().match(NodeKind::Or)) {
+        queue.merge(
+          node,
+          e_graph.node(NodeKind::And, {
+            e_graph.node(NodeKind::Not, {or_node->at(0)}),
+            e_graph.node(NodeKind::Not, {or_node->at(1)})
+          })
+        );
+      }
+      for (Node* not_node : node->at(0)->e_class().match(NodeKind::Not)) {
+        queue.merge(
+          node,
+          not_node->at(0)
+        );
+      }
+    }
+    
+    for (Node* node : e_graph.nodes_of_kind(NodeKind::And)) {
+      queue.merge(node, e_graph.node(NodeKind::And, {
+        node->at(1),
+        node->at(0)
+      }));
+      if (node->at(0)->e_class().match(NodeData(true)).not_empty()) {
+        queue.merge(node, node->at(1));
+      }
+      if (node->at(0) == node->at(1)) {
+        queue.merge(node, node->at(0));
+      }
+      for (Node* not_node : node->at(0)->e_class().match(NodeKind::Not)) {
+        if (not_node->at(0) == node->at(1)) {
+          queue.merge(node, e_graph.node(false));
+        }
+      }
+    }
+    
+    for (Node* node : e_graph.nodes_of_kind(NodeKind::Or)) {
+      queue.merge(node, e_graph.node(NodeKind::Or, {
+        node->at(1),
+        node->at(0)
+      }));
+      if (node->at(0)->e_class().match(NodeData(false)).not_empty()) {
+        queue.merge(node, node->at(1));
+      }
+      if (node->at(0) == node->at(1)) {
+        queue.merge(node, node->at(0));
+      }
+      for (Node* not_node : node->at(0)->e_class().match(NodeKind::Not)) {
+        if (not_node->at(0) == node->at(1)) {
+          queue.merge(node, e_graph.node(true));
         }
       }
     }
+    
     std::cout << queue.size() << std::endl;
   } while(e_graph.merge(queue));
   
   e_graph.save_dot("graph.gv");
   
-  EGraph::Extracted extracted = e_graph.extract();
+  EGraph::Extracted extracted = e_graph.extract(extraction_root);
   e_graph.save_dot("extracted.gv", extracted, extraction_root);
   
   return 0;
@@ -12,6 +12,11 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <functional>
+#include <map>
+#include <set>
+#include <sstream>
+
 #include "../egraphs.hpp"
 
 #undef assert
@@ -32,9 +37,102 @@ std::ostream& operator<<(std::ostream& stream, const NodeKind& node_kind) {
   return stream;
 }
 
+// Maps all nodes to the same bucket
+struct ConstantHasher {
+  template <class NodeData>
+  static size_t data(const NodeData& data, size_t child_count) { return 0; }
+  static size_t child(const void* child, size_t index) { return 0; }
+  static size_t finish(size_t hash) { return hash; }
+};
+
+// Tracks which classes are equivalent to X, treating G as identity.
+// Such classes are merged with X.
+struct XAnalysis {
+  using Data = bool;
+  
+  template <class EGraph>
+  Data make(EGraph& e_graph, typename EGraph::Node* node) {
+    switch (node->data().kind()) {
+      case NodeKind::X: return true;
+      case NodeKind::G: return e_graph.analysis(node->at(0));
+      default: return false;
+    }
+  }
+  
+  bool join(Data& a, const Data& b) {
+    bool changed = !a && b;
+    a = a || b;
+    return changed;
+  }
+  
+  template <class EGraph>
+  void modify(EGraph& e_graph, typename EGraph::Node* root, typename EGraph::MergeQueue& queue) {
+    if (e_graph.analysis(root)) {
+      queue.merge(root, e_graph.node(NodeKind::X));
+    }
+  }
+};
+
+// Linear congruential generator, so that random tests are reproducible
+class Random {
+private:
+  uint64_t _state;
+public:
+  explicit Random(uint64_t state): _state(state) {}
+  
+  size_t operator()(size_t max) {
+    _state = _state * 6364136223846793005 + 1442695040888963407;
+    return size_t(_state >> 33) % max;
+  }
+};
+
+// Adds count random nodes, whose children are picked from nodes, to the
+// e-graph. If nodes is empty, it is initialized with the leaves X, Y and
+// Z. Each node has one of the first kind_count kinds, where G is unary
+// and all other kinds are binary. Each node is merged with a random node
+// with a probability of 1 / merge_chance. Merges are applied every
+// merge_interval nodes and after the last node.
+template <class EGraph>
+void add_random_nodes(EGraph& e_graph,
+                      std::vector<typename EGraph::Node*>& nodes,
+                      Random& random,
+                      size_t count,
+                      size_t kind_count,
+                      size_t merge_chance,
+                      size_t merge_interval = 1) {
+  if (nodes.empty()) {
+    nodes = {
+      e_graph.node(NodeKind::X),
+      e_graph.node(NodeKind::Y),
+      e_graph.node(NodeKind::Z)
+    };
+  }
+  
+  typename EGraph::MergeQueue queue;
+  for (size_t it = 0; it < count; it++) {
+    NodeKind kind = NodeKind(random(kind_count));
+    if (kind == NodeKind::G) {
+      nodes.push_back(e_graph.node(kind, {nodes[random(nodes.size())]->root()}));
+    } else {
+      nodes.push_back(e_graph.node(kind, {
+        nodes[random(nodes.size())]->root(),
+        nodes[random(nodes.size())]->root()
+      }));
+    }
+    if (random(merge_chance) == 0) {
+      queue.merge(nodes.back(), nodes[random(nodes.size())]);
+    }
+    if ((it + 1) % merge_interval == 0) {
+      e_graph.merge(queue);
+    }
+  }
+  e_graph.merge(queue);
+}
+
 int main() {
-  using Node = egraphs::EGraph<NodeKind>::Node;
-  using EClass = egraphs::EGraph<NodeKind>::EClass;
+  using EGraph = egraphs::EGraph<NodeKind>;
+  using Node = EGraph::Node;
+  using EClass = EGraph::EClass;
   
   unittest::Test("Hashcons").run([](){
     egraphs::EGraph<NodeKind> e_graph;
@@ -90,6 +188,101 @@ int main() {
     
   });
   
+  unittest::Test("Hashcons (Grow)").run([](){
+    egraphs::EGraph<NodeKind> e_graph;
+    
+    // Builds enough nodes to force the hashcons to grow several times
+    std::vector<Node*> nodes;
+    nodes.push_back(e_graph.node(NodeKind::X));
+    for (size_t it = 0; it < 10000; it++) {
+      nodes.push_back(e_graph.node(NodeKind::F, {nodes.back()}));
+      nodes.push_back(e_graph.node(NodeKind::H, {nodes.back(), nodes[it]}));
+    }
+    
+    for (size_t it = 1; it < nodes.size(); it++) {
+      std::vector<Node*> children(nodes[it]->begin(), nodes[it]->end());
+      unittest_assert(e_graph.node(nodes[it]->data(), children) == nodes[it]);
+    }
+    
+    // Congruence closure must still find all nodes while migrating
+    e_graph.merge(nodes[0], e_graph.node(NodeKind::Y));
+    Node* y = e_graph.node(NodeKind::Y);
+    Node* a = e_graph.node(NodeKind::F, {y});
+    unittest_assert(a == nodes[1]->root());
+  });
+  
+  unittest::Test("Hashcons (Swiss)").run([](){
+    egraphs::EGraph<NodeKind, egraphs::SimpleNodeData<NodeKind>, egraphs::SwissHashcons> e_graph;
+    using Node = decltype(e_graph)::Node;
+    
+    unittest_assert(e_graph.node(NodeKind::X) == e_graph.node(NodeKind::X));
+    unittest_assert(e_graph.node(NodeKind::Y) != e_graph.node(NodeKind::X));
+    
+    std::vector<Node*> nodes;
+    nodes.push_back(e_graph.node(NodeKind::X));
+    for (size_t it = 0; it < 10000; it++) {
+      nodes.push_back(e_graph.node(NodeKind::F, {nodes.back()}));
+      nodes.push_back(e_graph.node(NodeKind::H, {nodes.back(), nodes[it]}));
+    }
+    
+    for (size_t it = 1; it < nodes.size(); it++) {
+      std::vector<Node*> children(nodes[it]->begin(), nodes[it]->end());
+      unittest_assert(e_graph.node(nodes[it]->data(), children) == nodes[it]);
+    }
+    
+    // Merging erases and reinserts all users
+    e_graph.merge(nodes[0], e_graph.node(NodeKind::Y));
+    unittest_assert(e_graph.node(NodeKind::F, {e_graph.node(NodeKind::Y)}) == nodes[1]->root());
+    
+    e_graph.merge(e_graph.node(NodeKind::F, {e_graph.node(NodeKind::A)}), e_graph.node(NodeKind::B));
+    e_graph.merge(e_graph.node(NodeKind::F, {e_graph.node(NodeKind::C)}), e_graph.node(NodeKind::Z));
+    e_graph.merge(e_graph.node(NodeKind::A), e_graph.node(NodeKind::C));
+    unittest_assert(e_graph.node(NodeKind::B) == e_graph.node(NodeKind::Z));
+  });
+  
+  unittest::Test("Hashcons (Custom Hasher)").run([](){
+    egraphs::EGraph<NodeKind, egraphs::SimpleNodeData<NodeKind>, egraphs::ChainedHashcons, ConstantHasher> e_graph;
+    
+    unittest_assert(e_graph.node(NodeKind::X) == e_graph.node(NodeKind::X));
+    unittest_assert(e_graph.node(NodeKind::Y) != e_graph.node(NodeKind::X));
+    
+    unittest_assert(e_graph.node(NodeKind::H, {
+      e_graph.node(NodeKind::X),
+      e_graph.node(NodeKind::Y)
+    }) != e_graph.node(NodeKind::H, {
+      e_graph.node(NodeKind::Y),
+      e_graph.node(NodeKind::X)
+    }));
+    
+    e_graph.merge(e_graph.node(NodeKind::X), e_graph.node(NodeKind::Y));
+    unittest_assert(e_graph.node(NodeKind::H, {
+      e_graph.node(NodeKind::X),
+      e_graph.node(NodeKind::Y)
+    }) == e_graph.node(NodeKind::H, {
+      e_graph.node(NodeKind::Y),
+      e_graph.node(NodeKind::X)
+    }));
+    unittest_assert(e_graph.hashcons().average_chain_length() == e_graph.hashcons().size());
+  });
+  
+  unittest::Test("Node Ids").run([](){
+    EGraph e_graph;
+    
+    Node* x = e_graph.node(NodeKind::X);
+    Node* y = e_graph.node(NodeKind::Y);
+    Node* f = e_graph.node(NodeKind::H, {x, y});
+    unittest_assert(e_graph.node(NodeKind::X) == x);
+    
+    unittest_assert(x->id() == 0);
+    unittest_assert(y->id() == 1);
+    unittest_assert(f->id() == 2);
+    unittest_assert(e_graph.node_count() == 3);
+    
+    e_graph.merge(x, y);
+    unittest_assert(e_graph.node(NodeKind::H, {x->root(), x->root()}) == f);
+    unittest_assert(e_graph.node_count() == 3);
+  });
+  
   unittest::Test("Transitive").run([](){
     egraphs::EGraph<NodeKind> e_graph;
     
@@ -203,6 +396,38 @@ int main() {
     unittest_assert(e_graph.node(NodeKind::A) == e_graph.node(NodeKind::B));
   });
   
+  unittest::Test("Congruent (Deferred)").run([](){
+    egraphs::EGraph<NodeKind> e_graph;
+    
+    e_graph.merge(e_graph.node(NodeKind::G, {
+      e_graph.node(NodeKind::F, {
+        e_graph.node(NodeKind::X)
+      })
+    }), e_graph.node(NodeKind::A));
+    e_graph.merge(e_graph.node(NodeKind::G, {
+      e_graph.node(NodeKind::F, {
+        e_graph.node(NodeKind::Y)
+      })
+    }), e_graph.node(NodeKind::B));
+    
+    EGraph::MergeQueue queue;
+    queue.merge(e_graph.node(NodeKind::X), e_graph.node(NodeKind::Z));
+    queue.merge(e_graph.node(NodeKind::Y), e_graph.node(NodeKind::Z));
+    unittest_assert(e_graph.merge_deferred(queue));
+    unittest_assert(!e_graph.is_clean());
+    unittest_assert(e_graph.node(NodeKind::X) == e_graph.node(NodeKind::Y));
+    
+    unittest_assert(e_graph.rebuild());
+    unittest_assert(e_graph.is_clean());
+    unittest_assert(e_graph.node(NodeKind::A) == e_graph.node(NodeKind::B));
+    unittest_assert(
+      e_graph.node(NodeKind::F, {e_graph.node(NodeKind::X)}) ==
+      e_graph.node(NodeKind::F, {e_graph.node(NodeKind::Z)})
+    );
+    
+    unittest_assert(!e_graph.rebuild());
+  });
+  
   unittest::Test("Match").run([](){
     egraphs::EGraph<NodeKind> e_graph;
     
@@ -287,5 +512,1170 @@ int main() {
     check_matches(c, NodeKind::X, 0);
   });
   
+  unittest::Test("Match (Kind Summary)").run([](){
+    EGraph e_graph;
+    
+    Node* a = e_graph.node(NodeKind::F, {e_graph.node(NodeKind::X)});
+    Node* b = e_graph.node(NodeKind::G, {e_graph.node(NodeKind::Y)});
+    
+    unittest_assert(a->e_class().may_contain(NodeKind::F));
+    unittest_assert(!a->e_class().may_contain(NodeKind::G));
+    unittest_assert(a->e_class().match(NodeKind::G).empty());
+    unittest_assert(a->e_class().match(NodeKind::F).not_empty());
+    
+    e_graph.merge(a, b);
+    unittest_assert(a->e_class().may_contain(NodeKind::F));
+    unittest_assert(a->e_class().may_contain(NodeKind::G));
+    unittest_assert(a->e_class().match(NodeKind::G).not_empty());
+    unittest_assert(b->e_class().match(NodeKind::F).not_empty());
+    unittest_assert(b->e_class().match(NodeKind::H).empty());
+  });
+  
+  unittest::Test("Scan").run([](){
+    EGraph e_graph;
+    
+    Node* a = e_graph.node(NodeKind::F, {e_graph.node(NodeKind::X)});
+    Node* b = e_graph.node(NodeKind::F, {e_graph.node(NodeKind::Y)});
+    Node* c = e_graph.node(NodeKind::G, {e_graph.node(NodeKind::X)});
+    
+    auto count_kind = [&](const NodeKind& kind){
+      size_t count = 0;
+      e_graph.scan(kind, [&](Node* node){
+        unittest_assert(node->data() == kind);
+        count++;
+      });
+      return count;
+    };
+    
+    unittest_assert(count_kind(NodeKind::F) == 2);
+    unittest_assert(count_kind(NodeKind::G) == 1);
+    unittest_assert(count_kind(NodeKind::H) == 0);
+    
+    // Congruent nodes are removed from the hashcons and not visited
+    e_graph.merge(e_graph.node(NodeKind::X), e_graph.node(NodeKind::Y));
+    unittest_assert(count_kind(NodeKind::F) == 1);
+    
+    size_t count = 0;
+    e_graph.scan([&](Node* node){ count++; });
+    unittest_assert(count == 4);
+    
+    unittest_assert(e_graph.node_by_id(c->id()) == c);
+    unittest_assert(a->root() == b->root());
+  });
+  
+  unittest::Test("Nodes of Kind").run([](){
+    EGraph e_graph;
+    
+    Node* a = e_graph.node(NodeKind::F, {e_graph.node(NodeKind::X)});
+    Node* b = e_graph.node(NodeKind::F, {e_graph.node(NodeKind::Y)});
+    e_graph.node(NodeKind::G, {e_graph.node(NodeKind::X)});
+    
+    auto count_kind = [&](const NodeKind& kind){
+      size_t count = 0;
+      for (Node* node : e_graph.nodes_of_kind(kind)) {
+        unittest_assert(node->data() == kind);
+        count++;
+      }
+      return count;
+    };
+    
+    unittest_assert(count_kind(NodeKind::F) == 2);
+    unittest_assert(count_kind(NodeKind::G) == 1);
+    unittest_assert(count_kind(NodeKind::H) == 0);
+    unittest_assert(e_graph.nodes_of_kind(NodeKind::H).empty());
+    
+    // Creating nodes while iterating is allowed
+    size_t count = 0;
+    for (Node* node : e_graph.nodes_of_kind(NodeKind::F)) {
+      e_graph.node(NodeKind::F, {node});
+      count++;
+    }
+    unittest_assert(count == 2);
+    unittest_assert(count_kind(NodeKind::F) == 4);
+    
+    // Merging evicts congruent duplicates
+    e_graph.merge(e_graph.node(NodeKind::X), e_graph.node(NodeKind::Y));
+    unittest_assert(a->root() == b->root());
+    unittest_assert(count_kind(NodeKind::F) == 2);
+    
+    // Merging and rebuilding while iterating is allowed
+    std::vector<Node*> leaves;
+    Node* leaf = e_graph.node(NodeKind::Z);
+    for (size_t it = 0; it < 8; it++) {
+      leaves.push_back(leaf);
+      e_graph.node(NodeKind::G, {leaf});
+      leaf = e_graph.node(NodeKind::H, {leaf});
+    }
+    count = 0;
+    for (Node* node : e_graph.nodes_of_kind(NodeKind::G)) {
+      (void) node;
+      if (count < leaves.size() - 1) {
+        e_graph.merge(leaves[count], leaves[count + 1]);
+        e_graph.rebuild();
+      }
+      count++;
+    }
+    unittest_assert(count == 2);
+    unittest_assert(count_kind(NodeKind::G) == 2);
+  });
+  
+  unittest::Test("Pattern").run([](){
+    using Pattern = EGraph::Pattern;
+    EGraph e_graph;
+    
+    Node* x = e_graph.node(NodeKind::X);
+    Node* y = e_graph.node(NodeKind::Y);
+    Node* a = e_graph.node(NodeKind::F, {e_graph.node(NodeKind::H, {x, y})});
+    Node* b = e_graph.node(NodeKind::F, {e_graph.node(NodeKind::H, {x, x})});
+    e_graph.node(NodeKind::G, {e_graph.node(NodeKind::H, {y, x})});
+    
+    Pattern pattern(NodeKind::F, {Pattern(NodeKind::H, {Pattern::var(0), Pattern::var(1)})});
+    std::ostringstream stream;
+    pattern.write(stream);
+    unittest_assert(stream.str() == "F(H(?0, ?1))");
+    
+    EGraph::Program program(pattern);
+    std::vector<EGraph::Match> matches = program.search(e_graph);
+    unittest_assert(matches.size() == 2);
+    for (const EGraph::Match& match : matches) {
+      unittest_assert(match.root == a || match.root == b);
+      unittest_assert(match.subst[0] == x);
+      unittest_assert(match.subst[1] == (match.root == a ? y : x));
+    }
+    
+    // Repeated variables
+    EGraph::Program same(Pattern(NodeKind::H, {Pattern::var(0), Pattern::var(0)}));
+    matches = same.search(e_graph);
+    unittest_assert(matches.size() == 1);
+    unittest_assert(matches[0].subst[0] == x);
+    
+    // Matching across equivalence classes
+    e_graph.merge(y, e_graph.node(NodeKind::G, {x}));
+    EGraph::Program nested(Pattern(NodeKind::H, {Pattern::var(0), Pattern(NodeKind::G, {Pattern::var(0)})}));
+    matches = nested.search(e_graph);
+    unittest_assert(matches.size() == 1);
+    unittest_assert(matches[0].root == e_graph.node(NodeKind::H, {x, y->root()}));
+    
+    size_t count = 0;
+    nested.search_class(a->at(0), [&](Node* root, const std::vector<Node*>& subst){
+      unittest_assert(subst[0] == x);
+      count++;
+    });
+    unittest_assert(count == 1);
+    
+    // Instantiation
+    Pattern rhs(NodeKind::G, {Pattern::var(1), Pattern(NodeKind::Z)});
+    Node* instance = e_graph.instantiate(rhs, {x, y->root()});
+    unittest_assert(instance == e_graph.node(NodeKind::G, {y->root(), e_graph.node(NodeKind::Z)}));
+  });
+  
+  unittest::Test("Query").run([](){
+    using Pattern = EGraph::Pattern;
+    EGraph e_graph;
+    
+    std::vector<Node*> leaves;
+    for (NodeKind kind : {NodeKind::X, NodeKind::Y, NodeKind::Z, NodeKind::A}) {
+      leaves.push_back(e_graph.node(kind));
+      e_graph.merge(leaves.back(), e_graph.node(NodeKind::G, {leaves.back()}));
+    }
+    for (Node* a : leaves) {
+      for (Node* b : leaves) {
+        e_graph.node(NodeKind::H, {a->root(), e_graph.node(NodeKind::G, {b->root()})});
+      }
+    }
+    e_graph.merge(leaves[0], leaves[1]);
+    
+    std::vector<Pattern> patterns = {
+      Pattern(NodeKind::H, {Pattern::var(0), Pattern(NodeKind::G, {Pattern::var(0)})}),
+      Pattern(NodeKind::H, {Pattern::var(0), Pattern::var(1)}),
+      Pattern(NodeKind::H, {Pattern::var(1), Pattern::var(1)}),
+      Pattern(NodeKind::G, {Pattern(NodeKind::G, {Pattern::var(0)})}),
+      Pattern::var(0),
+      Pattern::var(1)
+    };
+    
+    // Relational e-matching finds the same matches as backtracking
+    for (const Pattern& pattern : patterns) {
+      std::set<std::pair<Node*, std::vector<Node*>>> expected;
+      EGraph::Program(pattern).search(e_graph, [&](Node* root, const std::vector<Node*>& subst){
+        expected.insert({root, subst});
+      });
+      
+      std::set<std::pair<Node*, std::vector<Node*>>> found;
+      EGraph::Query query(pattern);
+      unittest_assert(query.var_count() == pattern.var_count());
+      for (const EGraph::Match& match : query.search(e_graph)) {
+        unittest_assert(found.insert({match.root, match.subst}).second);
+      }
+      
+      unittest_assert(!found.empty());
+      unittest_assert(found == expected);
+    }
+    
+    // Bare variables bind the root to their own index
+    for (const EGraph::Match& match : EGraph::Query(Pattern::var(1)).search(e_graph)) {
+      unittest_assert(match.subst.size() == 2);
+      unittest_assert(match.subst[0] == nullptr);
+      unittest_assert(match.subst[1] == match.root);
+    }
+    
+    // Callbacks may create nodes while the roots are searched
+    const EGraph::Query query(Pattern::var(0));
+    const EGraph::Program program(Pattern::var(0));
+    size_t root_count = e_graph.roots().size();
+    size_t matches = 0;
+    auto create = [&](Node* root, const std::vector<Node*>& subst){
+      e_graph.node(NodeKind::F, {root});
+      matches++;
+    };
+    query.search(e_graph, create);
+    unittest_assert(matches == root_count);
+    matches = 0;
+    program.search(e_graph, create);
+    unittest_assert(matches == 2 * root_count);
+  });
+  
+  unittest::Test("Search Since").run([](){
+    using Pattern = EGraph::Pattern;
+    using Key = std::pair<Node*, std::vector<Node*>>;
+    EGraph e_graph;
+    
+    EGraph::Program program(Pattern(NodeKind::H, {
+      Pattern::var(0),
+      Pattern(NodeKind::G, {Pattern::var(0)})
+    }));
+    
+    auto canonicalize = [](const Key& key){
+      Key result(key.first->root(), {});
+      for (Node* node : key.second) {
+        result.second.push_back(node->root());
+      }
+      return result;
+    };
+    
+    auto search = [&](uint64_t since){
+      std::set<Key> matches;
+      program.search_since(e_graph, since, [&](Node* root, const std::vector<Node*>& subst){
+        matches.insert({root, subst});
+      });
+      return matches;
+    };
+    
+    std::vector<Node*> leaves;
+    for (NodeKind kind : {NodeKind::X, NodeKind::Y, NodeKind::Z, NodeKind::A, NodeKind::B, NodeKind::C}) {
+      leaves.push_back(e_graph.node(kind));
+    }
+    for (size_t it = 0; it + 1 < leaves.size(); it++) {
+      e_graph.node(NodeKind::H, {leaves[it], e_graph.node(NodeKind::G, {leaves[it + 1]})});
+    }
+    e_graph.node(NodeKind::H, {leaves[0], e_graph.node(NodeKind::G, {leaves[0]})});
+    
+    // Searching since epoch 0 finds all matches
+    std::set<Key> before = search(0);
+    unittest_assert(before.size() == 1);
+    uint64_t epoch = e_graph.epoch();
+    unittest_assert(search(epoch).empty());
+    
+    e_graph.merge(leaves[2], leaves[3]);
+    e_graph.node(NodeKind::H, {leaves[4], e_graph.node(NodeKind::G, {leaves[4]})});
+    unittest_assert(e_graph.epoch() > epoch);
+    
+    std::set<Key> after = search(0);
+    std::set<Key> changed = search(epoch);
+    unittest_assert(after.size() == 3);
+    
+    std::set<Key> old;
+    for (const Key& key : before) {
+      old.insert(canonicalize(key));
+    }
+    for (const Key& key : after) {
+      unittest_assert(old.count(key) > 0 || changed.count(key) > 0);
+    }
+    for (const Key& key : changed) {
+      unittest_assert(after.count(key) > 0);
+      unittest_assert(old.count(key) == 0);
+    }
+    
+    // Deferred merges are visible after rebuild
+    epoch = e_graph.epoch();
+    e_graph.merge_deferred(leaves[0], leaves[1]);
+    e_graph.rebuild();
+    unittest_assert(!search(epoch).empty());
+    unittest_assert(search(e_graph.epoch()).empty());
+  });
+  
+  unittest::Test("Runner").run([](){
+    using Pattern = EGraph::Pattern;
+    using Rule = EGraph::Rule;
+    
+    std::vector<Rule> rules = {
+      Rule("comm", Pattern(NodeKind::H, {Pattern::var(0), Pattern::var(1)}),
+                   Pattern(NodeKind::H, {Pattern::var(1), Pattern::var(0)})),
+      Rule("assoc", Pattern(NodeKind::H, {Pattern::var(0), Pattern(NodeKind::H, {Pattern::var(1), Pattern::var(2)})}),
+                    Pattern(NodeKind::H, {Pattern(NodeKind::H, {Pattern::var(0), Pattern::var(1)}), Pattern::var(2)})),
+      Rule("double", Pattern(NodeKind::G, {Pattern(NodeKind::G, {Pattern::var(0)})}), Pattern::var(0))
+    };
+    
+    auto build = [](EGraph& e_graph){
+      Node* sum = e_graph.node(NodeKind::X);
+      for (NodeKind kind : {NodeKind::Y, NodeKind::Z, NodeKind::A, NodeKind::B, NodeKind::C}) {
+        sum = e_graph.node(NodeKind::H, {e_graph.node(kind), sum});
+      }
+      return e_graph.node(NodeKind::G, {e_graph.node(NodeKind::G, {sum})});
+    };
+    
+    {
+      EGraph e_graph;
+      Node* x = e_graph.node(NodeKind::X);
+      Node* y = e_graph.node(NodeKind::Y);
+      Node* a = e_graph.node(NodeKind::H, {x, e_graph.node(NodeKind::G, {e_graph.node(NodeKind::G, {y})})});
+      
+      EGraph::Runner::Report report = EGraph::Runner().run(e_graph, rules);
+      unittest_assert(report.stop_reason == egraphs::StopReason::Saturated);
+      unittest_assert(report.iterations > 1);
+      unittest_assert(a->root() == e_graph.node(NodeKind::H, {y, x}));
+    }
+    
+    {
+      EGraph e_graph;
+      Node* root = build(e_graph);
+      EGraph::Runner::Report report = EGraph::Runner().node_limit(100000).run(e_graph, rules);
+      unittest_assert(report.stop_reason == egraphs::StopReason::Saturated);
+      
+      Node* reversed = e_graph.node(NodeKind::C);
+      for (NodeKind kind : {NodeKind::B, NodeKind::A, NodeKind::Z, NodeKind::Y, NodeKind::X}) {
+        reversed = e_graph.node(NodeKind::H, {reversed, e_graph.node(kind)});
+      }
+      unittest_assert(root->root() == reversed->root());
+    }
+    
+    {
+      EGraph e_graph;
+      build(e_graph);
+      EGraph::Runner::Report report = EGraph::Runner().node_limit(100).run(e_graph, rules);
+      unittest_assert(report.stop_reason == egraphs::StopReason::NodeLimit);
+      unittest_assert(e_graph.is_clean());
+    }
+    
+    {
+      EGraph e_graph;
+      build(e_graph);
+      EGraph::Runner::Report report = EGraph::Runner().iteration_limit(2).run(e_graph, rules);
+      unittest_assert(report.stop_reason == egraphs::StopReason::IterationLimit);
+      unittest_assert(report.iterations == 2);
+    }
+    
+    {
+      EGraph e_graph;
+      build(e_graph);
+      EGraph::Runner::Report report = EGraph::Runner().memory_limit(e_graph.memory_usage()).run(e_graph, rules);
+      unittest_assert(report.stop_reason == egraphs::StopReason::MemoryLimit);
+      unittest_assert(report.iterations == 1);
+    }
+    
+    {
+      EGraph e_graph;
+      build(e_graph);
+      EGraph::Runner::Report report = EGraph::Runner().time_limit(0.0).run(e_graph, rules);
+      unittest_assert(report.stop_reason == egraphs::StopReason::TimeLimit);
+    }
+  });
+  
+  unittest::Test("Backoff Scheduler").run([](){
+    using Pattern = EGraph::Pattern;
+    using Rule = EGraph::Rule;
+    
+    egraphs::BackoffScheduler scheduler(4, 2);
+    unittest_assert(scheduler.can_apply(0, 0, 4));
+    unittest_assert(!scheduler.can_apply(0, 0, 5));
+    unittest_assert(scheduler.times_banned(0) == 1);
+    unittest_assert(!scheduler.can_search(1, 0));
+    unittest_assert(scheduler.can_search(1, 1));
+    unittest_assert(scheduler.can_search(2, 0));
+    
+    // Match limit and ban length are doubled
+    unittest_assert(scheduler.can_apply(2, 0, 8));
+    unittest_assert(!scheduler.can_apply(2, 0, 9));
+    unittest_assert(scheduler.is_banned(5, 0));
+    unittest_assert(!scheduler.is_banned(6, 0));
+    
+    // Bans are lifted once no other rule changes the e-graph
+    unittest_assert(!scheduler.can_stop(3));
+    unittest_assert(scheduler.can_search(4, 0));
+    unittest_assert(scheduler.can_stop(4));
+    
+    // Limits saturate instead of overflowing
+    egraphs::BackoffScheduler large(SIZE_MAX / 2, SIZE_MAX / 2);
+    unittest_assert(!large.can_apply(1, 0, SIZE_MAX));
+    unittest_assert(!large.can_apply(1, 0, SIZE_MAX));
+    unittest_assert(large.is_banned(SIZE_MAX - 1, 0));
+    unittest_assert(large.can_apply(1, 0, SIZE_MAX));
+    
+    std::vector<Rule> rules = {
+      Rule("comm", Pattern(NodeKind::H, {Pattern::var(0), Pattern::var(1)}),
+                   Pattern(NodeKind::H, {Pattern::var(1), Pattern::var(0)})),
+      Rule("assoc", Pattern(NodeKind::H, {Pattern::var(0), Pattern(NodeKind::H, {Pattern::var(1), Pattern::var(2)})}),
+                    Pattern(NodeKind::H, {Pattern(NodeKind::H, {Pattern::var(0), Pattern::var(1)}), Pattern::var(2)})),
+      Rule("double", Pattern(NodeKind::G, {Pattern(NodeKind::G, {Pattern::var(0)})}), Pattern::var(0))
+    };
+    
+    EGraph e_graph;
+    Node* sum = e_graph.node(NodeKind::X);
+    for (NodeKind kind : {NodeKind::Y, NodeKind::Z, NodeKind::A, NodeKind::B, NodeKind::C}) {
+      sum = e_graph.node(NodeKind::H, {e_graph.node(kind), sum});
+    }
+    Node* root = e_graph.node(NodeKind::G, {e_graph.node(NodeKind::G, {sum})});
+    
+    // Banned rules are searched again later, so saturation reaches the
+    // same result.
+    egraphs::BackoffScheduler backoff(8, 1);
+    EGraph::Runner::Report report = EGraph::Runner().node_limit(100000).run(e_graph, rules, backoff);
+    unittest_assert(report.stop_reason == egraphs::StopReason::Saturated);
+    unittest_assert(backoff.times_banned(0) > 0);
+    unittest_assert(backoff.times_banned(1) > 0);
+    unittest_assert(backoff.times_banned(2) == 0);
+    unittest_assert(root->root() == sum->root());
+    
+    Node* reversed = e_graph.node(NodeKind::C);
+    for (NodeKind kind : {NodeKind::B, NodeKind::A, NodeKind::Z, NodeKind::Y, NodeKind::X}) {
+      reversed = e_graph.node(NodeKind::H, {reversed, e_graph.node(kind)});
+    }
+    unittest_assert(sum->root() == reversed->root());
+    unittest_assert(e_graph.roots().size() == 63 + 1);
+  });
+  
+  unittest::Test("Parallel Search").run([](){
+    using Pattern = EGraph::Pattern;
+    using Rule = EGraph::Rule;
+    
+    egraphs::ThreadPool pool(4);
+    unittest_assert(pool.size() == 4);
+    
+    std::vector<size_t> counts(1000, 0);
+    pool.parallel_for(counts.size(), [&](size_t index, size_t thread){
+      unittest_assert(thread < pool.size());
+      counts[index]++;
+    });
+    for (size_t count : counts) {
+      unittest_assert(count == 1);
+    }
+    
+    EGraph e_graph;
+    std::vector<Node*> nodes;
+    for (NodeKind kind : {NodeKind::X, NodeKind::Y, NodeKind::Z, NodeKind::A}) {
+      nodes.push_back(e_graph.node(kind));
+    }
+    for (size_t it = 0; it < 400; it++) {
+      Node* a = nodes[(it * 7) % nodes.size()];
+      Node* b = nodes[(it * 13 + 5) % nodes.size()];
+      if (it % 3 == 0) {
+        nodes.push_back(e_graph.node(NodeKind::G, {a}));
+      } else if (it % 3 == 1) {
+        nodes.push_back(e_graph.node(NodeKind::H, {a, b}));
+      } else {
+        nodes.push_back(e_graph.node(NodeKind::H, {a, e_graph.node(NodeKind::G, {a})}));
+      }
+    }
+    for (size_t it = 0; it < 40; it++) {
+      e_graph.merge(nodes[it * 11 % nodes.size()], nodes[it * 17 % nodes.size()]);
+    }
+    
+    std::vector<Pattern> patterns = {
+      Pattern(NodeKind::H, {Pattern::var(0), Pattern(NodeKind::G, {Pattern::var(0)})}),
+      Pattern(NodeKind::H, {Pattern::var(0), Pattern::var(1)}),
+      Pattern::var(0)
+    };
+    
+    auto equal = [](const std::vector<EGraph::Match>& a, const std::vector<EGraph::Match>& b){
+      if (a.size() != b.size()) {
+        return false;
+      }
+      for (size_t it = 0; it < a.size(); it++) {
+        if (a[it].root != b[it].root || a[it].subst != b[it].subst) {
+          return false;
+        }
+      }
+      return true;
+    };
+    
+    // Parallel search yields the same matches in the same order
+    for (const Pattern& pattern : patterns) {
+      EGraph::Program program(pattern);
+      std::vector<EGraph::Match> matches = program.search(e_graph);
+      unittest_assert(!matches.empty());
+      unittest_assert(equal(program.search(e_graph, pool), matches));
+      
+      uint64_t epoch = e_graph.epoch() - 10;
+      std::vector<EGraph::Match> changed = program.search_since(e_graph, epoch);
+      std::vector<EGraph::Match> changed_parallel = program.search_since(e_graph, epoch, pool);
+      unittest_assert(changed.size() == changed_parallel.size());
+    }
+    
+    std::vector<Rule> rules = {
+      Rule("comm", Pattern(NodeKind::H, {Pattern::var(0), Pattern::var(1)}),
+                   Pattern(NodeKind::H, {Pattern::var(1), Pattern::var(0)})),
+      Rule("double", Pattern(NodeKind::G, {Pattern(NodeKind::G, {Pattern::var(0)})}), Pattern::var(0))
+    };
+    
+    EGraph sequential;
+    Node* a = sequential.node(NodeKind::G, {sequential.node(NodeKind::G, {sequential.node(NodeKind::H, {sequential.node(NodeKind::X), sequential.node(NodeKind::Y)})})});
+    EGraph parallel;
+    Node* b = parallel.node(NodeKind::G, {parallel.node(NodeKind::G, {parallel.node(NodeKind::H, {parallel.node(NodeKind::X), parallel.node(NodeKind::Y)})})});
+    
+    EGraph::Runner::Report report = EGraph::Runner().run(sequential, rules);
+    EGraph::Runner::Report parallel_report = EGraph::Runner().thread_pool(&pool).run(parallel, rules);
+    unittest_assert(parallel_report.stop_reason == egraphs::StopReason::Saturated);
+    unittest_assert(parallel_report.iterations == report.iterations);
+    unittest_assert(parallel.node_count() == sequential.node_count());
+    unittest_assert(b->root() == parallel.node(NodeKind::H, {parallel.node(NodeKind::Y), parallel.node(NodeKind::X)}));
+    unittest_assert(a->root() == sequential.node(NodeKind::H, {sequential.node(NodeKind::Y), sequential.node(NodeKind::X)}));
+  });
+  
+  unittest::Test("Concurrent Insertion").run([](){
+    egraphs::ThreadPool pool(4);
+    EGraph e_graph;
+    
+    std::vector<Node*> leaves;
+    for (NodeKind kind : {NodeKind::X, NodeKind::Y, NodeKind::Z, NodeKind::A}) {
+      leaves.push_back(e_graph.node(kind));
+    }
+    e_graph.merge(leaves[2], e_graph.node(NodeKind::G, {leaves[3]}));
+    
+    // Every node is created by many threads
+    e_graph.begin_concurrent(pool.size(), 64);
+    pool.parallel_for(1000, [&](size_t index, size_t thread){
+      Node* a = leaves[index % 4]->find();
+      Node* b = leaves[(index / 4) % 4]->find();
+      Node* h = e_graph.concurrent_node(thread, NodeKind::H, {a, b});
+      unittest_assert(h == e_graph.concurrent_node(thread, NodeKind::H, {a, b}));
+      e_graph.concurrent_node(thread, NodeKind::G, {h});
+    });
+    e_graph.end_concurrent();
+    
+    unittest_assert(e_graph.node_count() == 5 + 16 + 16);
+    unittest_assert(e_graph.hashcons().size() == e_graph.node_count());
+    for (size_t it = 0; it < e_graph.node_count(); it++) {
+      unittest_assert(e_graph.node_by_id(uint32_t(it))->id() == it);
+    }
+    
+    // Nodes are registered with their children
+    Node* ha = e_graph.node(NodeKind::H, {leaves[0], leaves[1]});
+    Node* hb = e_graph.node(NodeKind::H, {leaves[1], leaves[1]});
+    unittest_assert(e_graph.node_count() == 5 + 16 + 16);
+    e_graph.merge(leaves[0], leaves[1]);
+    unittest_assert(ha->root() == hb->root());
+    unittest_assert(e_graph.node(NodeKind::G, {ha->root()})->root() == e_graph.node(NodeKind::G, {hb->root()})->root());
+    
+    // The number of new nodes is limited
+    e_graph.begin_concurrent(1, 1);
+    Node* b = e_graph.concurrent_node(0, NodeKind::B);
+    unittest_assert(b != nullptr);
+    unittest_assert(e_graph.concurrent_node(0, NodeKind::C) == nullptr);
+    unittest_assert(e_graph.concurrent_node(0, NodeKind::B) == b);
+    bool thrown = false;
+    try {
+      e_graph.end_concurrent();
+    } catch (const egraphs::Error& error) {
+      thrown = true;
+    }
+    unittest_assert(thrown);
+    unittest_assert(e_graph.node_count() == 5 + 16 + 16 + 1);
+    unittest_assert(b->id() == 5 + 16 + 16);
+  });
+  
+  unittest::Test("Concurrent Merge").run([](){
+    egraphs::ThreadPool pool(4);
+    
+    auto build = [](EGraph& e_graph){
+      std::vector<Node*> chain;
+      chain.push_back(e_graph.node(NodeKind::X));
+      for (size_t it = 1; it < 200; it++) {
+        chain.push_back(e_graph.node(NodeKind::G, {chain.back()}));
+        e_graph.node(NodeKind::H, {chain.back(), chain[0]});
+      }
+      return chain;
+    };
+    
+    EGraph sequential;
+    std::vector<Node*> sequential_chain = build(sequential);
+    for (size_t it = 0; it + 3 < sequential_chain.size(); it += 3) {
+      sequential.merge(sequential_chain[it], sequential_chain[it + 3]);
+    }
+    
+    EGraph e_graph;
+    std::vector<Node*> chain = build(e_graph);
+    std::atomic<size_t> merged(0);
+    e_graph.begin_concurrent_merge(pool.size());
+    pool.parallel_for(chain.size(), [&](size_t index, size_t thread){
+      if (index % 3 == 0 && index + 3 < chain.size()) {
+        if (e_graph.concurrent_merge(thread, chain[index], chain[index + 3])) {
+          merged++;
+        }
+      }
+    });
+    e_graph.end_concurrent_merge();
+    unittest_assert(merged == 66);
+    unittest_assert(!e_graph.is_clean());
+    e_graph.rebuild();
+    unittest_assert(e_graph.is_clean());
+    
+    // Congruence closure yields the same classes as sequential merging
+    unittest_assert(e_graph.roots().size() == sequential.roots().size());
+    for (size_t it = 0; it < chain.size(); it++) {
+      unittest_assert(chain[it]->root() == chain[it % 3]->root());
+      unittest_assert(EClass(chain[it]).may_contain(it == 0 ? NodeKind::X : NodeKind::G));
+    }
+    unittest_assert(e_graph.node(NodeKind::H, {chain[4]->root(), chain[0]->root()})->root() ==
+                    e_graph.node(NodeKind::H, {chain[1]->root(), chain[0]->root()})->root());
+    
+    
+    // Congruent nodes were evicted: The class contains X and G(G(G(X)))
+    std::vector<Node*> e_class(chain[0]->e_class().begin(), chain[0]->e_class().end());
+    unittest_assert(e_class.size() == 2);
+    unittest_assert(e_graph.hashcons().size() == sequential.hashcons().size());
+  });
+  
+  unittest::Test("Analysis").run([](){
+    using XEGraph = egraphs::EGraph<NodeKind,
+                                    egraphs::SimpleNodeData<NodeKind>,
+                                    egraphs::ChainedHashcons,
+                                    egraphs::NodeHasher,
+                                    XAnalysis>;
+    using XNode = XEGraph::Node;
+    XEGraph e_graph;
+    
+    XNode* x = e_graph.node(NodeKind::X);
+    XNode* y = e_graph.node(NodeKind::Y);
+    XNode* z = e_graph.node(NodeKind::Z);
+    XNode* gx = e_graph.node(NodeKind::G, {e_graph.node(NodeKind::G, {x})});
+    XNode* gy = e_graph.node(NodeKind::G, {e_graph.node(NodeKind::G, {y})});
+    XNode* hy = e_graph.node(NodeKind::H, {y, z});
+    unittest_assert(e_graph.analysis(gx));
+    unittest_assert(!e_graph.analysis(gy));
+    
+    // Merges requested by modify are executed by merge and rebuild
+    unittest_assert(gx->root() != x->root());
+    unittest_assert(e_graph.rebuild());
+    unittest_assert(gx->root() == x->root());
+    
+    // Changes propagate to users
+    e_graph.merge(y, x);
+    unittest_assert(e_graph.analysis(gy));
+    unittest_assert(gy->root() == x->root());
+    unittest_assert(!e_graph.analysis(hy));
+    
+    e_graph.merge_deferred(z, gy);
+    e_graph.rebuild();
+    unittest_assert(e_graph.analysis(hy) == false);
+    unittest_assert(z->root() == x->root());
+    
+    // Nodes created concurrently are analyzed in topological order
+    XNode* a = e_graph.node(NodeKind::A);
+    XNode* b = e_graph.node(NodeKind::B);
+    e_graph.begin_concurrent(2, 16);
+    XNode* ga = e_graph.concurrent_node(1, NodeKind::G, {a});
+    XNode* gga = e_graph.concurrent_node(0, NodeKind::G, {ga});
+    XNode* gb = e_graph.concurrent_node(0, NodeKind::G, {b});
+    e_graph.end_concurrent();
+    unittest_assert(gga->id() < ga->id());
+    
+    e_graph.merge_deferred(a, x);
+    e_graph.rebuild();
+    unittest_assert(e_graph.analysis(gga));
+    unittest_assert(gga->root() == x->root());
+    unittest_assert(!e_graph.analysis(gb));
+    unittest_assert(gb->root() != x->root());
+    
+    // Classes united by concurrent_merge join their data in both orders
+    for (size_t order = 0; order < 2; order++) {
+      XEGraph e_graph;
+      XNode* x = e_graph.node(NodeKind::X);
+      XNode* y = e_graph.node(NodeKind::Y);
+      XNode* gy = e_graph.node(NodeKind::G, {y});
+      
+      e_graph.begin_concurrent_merge(1);
+      if (order == 0) {
+        e_graph.concurrent_merge(0, x, y);
+      } else {
+        e_graph.concurrent_merge(0, y, x);
+      }
+      e_graph.end_concurrent_merge();
+      e_graph.rebuild();
+      
+      unittest_assert(e_graph.analysis(x));
+      unittest_assert(e_graph.analysis(y));
+      unittest_assert(e_graph.analysis(gy));
+      unittest_assert(gy->root() == x->root());
+    }
+  });
+  
+  unittest::Test("Extract").run([](){
+    EGraph e_graph;
+    
+    Node* x = e_graph.node(NodeKind::X);
+    Node* y = e_graph.node(NodeKind::Y);
+    Node* gy = e_graph.node(NodeKind::G, {y});
+    Node* f = e_graph.node(NodeKind::F, {x, gy});
+    Node* h = e_graph.node(NodeKind::H, {f});
+    e_graph.merge(x, gy);
+    
+    EGraph::Extracted extracted = e_graph.extract();
+    unittest_assert(extracted.size() == e_graph.roots().size());
+    unittest_assert(extracted.at(gy->root()) == x);
+    unittest_assert(extracted.at(h->root()) == h);
+    
+    // Map-compatible interface
+    size_t count = 0;
+    for (const auto& [root, node] : extracted) {
+      unittest_assert(root->root() == root);
+      unittest_assert(node->root() == root);
+      unittest_assert(extracted.at(root) == node);
+      count++;
+    }
+    unittest_assert(count == extracted.size());
+    Node* non_root = gy->root() == gy ? x : gy;
+    unittest_assert(extracted.find(gy->root())->second == x);
+    unittest_assert(extracted.find(non_root) == extracted.end());
+    unittest_assert(extracted.count(h) == 1);
+    unittest_assert(extracted.count(non_root) == 0);
+    
+    // Custom cost functions look up the costs of children
+    Node* z = e_graph.node(NodeKind::Z);
+    e_graph.merge(f, z);
+    extracted = e_graph.extract([&](Node* node, const EGraph::Costs& costs){
+      EGraph::Cost cost = node->data().kind() == NodeKind::Z ? 100 : 1;
+      for (Node* child : *node) {
+        cost += costs.at(child);
+      }
+      return cost;
+    });
+    unittest_assert(extracted.at(f->root()) == f);
+    
+    extracted = e_graph.extract();
+    unittest_assert(extracted.at(f->root())->data().kind() == NodeKind::Z);
+    
+    // Data cost functions and std::function cost functions
+    extracted = e_graph.extract([](const egraphs::SimpleNodeData<NodeKind>& data){
+      return data.kind() == NodeKind::Z ? 100 : 1;
+    });
+    unittest_assert(extracted.at(f->root()) == f);
+    
+    EGraph::DataCostFn data_cost = [](const egraphs::SimpleNodeData<NodeKind>& data){
+      return data.kind() == NodeKind::X ? 100 : 1;
+    };
+    extracted = e_graph.extract(data_cost);
+    unittest_assert(extracted.at(x->root()) == gy);
+    
+    EGraph::CostFn cost_fn = [](Node* node, const EGraph::Costs& costs){
+      EGraph::Cost cost = node->data().kind() == NodeKind::F ? 100 : 1;
+      for (Node* child : *node) {
+        cost += costs.at(child);
+      }
+      return cost;
+    };
+    extracted = e_graph.extract(cost_fn);
+    unittest_assert(extracted.at(f->root()) == z);
+    unittest_assert(!extracted.contains(f->root() == f ? z : f));
+  });
+  
+  unittest::Test("Extract (Cone)").run([](){
+    EGraph e_graph;
+    
+    Node* x = e_graph.node(NodeKind::X);
+    Node* y = e_graph.node(NodeKind::Y);
+    Node* z = e_graph.node(NodeKind::Z);
+    Node* f = e_graph.node(NodeKind::F, {x, e_graph.node(NodeKind::G, {y})});
+    Node* h = e_graph.node(NodeKind::H, {z});
+    e_graph.merge(x, e_graph.node(NodeKind::G, {f}));
+    e_graph.merge(h, e_graph.node(NodeKind::A));
+    
+    EGraph::Extracted all = e_graph.extract();
+    EGraph::Extracted cone = e_graph.extract(f);
+    
+    // The cone of f contains the classes of f, x, y and G(y)
+    unittest_assert(cone.size() == 4);
+    unittest_assert(cone.contains(y->root()));
+    unittest_assert(!cone.contains(z->root()));
+    unittest_assert(!cone.contains(h->root()));
+    for (Node* root : cone.index().roots()) {
+      unittest_assert(cone.at(root) == all.at(root));
+    }
+    
+    cone = e_graph.extract(h, [](Node* node, const EGraph::Costs& costs){
+      EGraph::Cost cost = node->data().kind() == NodeKind::A ? 10 : 1;
+      for (Node* child : *node) {
+        cost += costs.at(child);
+      }
+      return cost;
+    });
+    unittest_assert(cone.size() == 2);
+    unittest_assert(cone.at(h->root()) == h);
+    
+    // Cones spanning a large range of ids
+    Node* chain = y->root();
+    for (size_t it = 0; it < 100; it++) {
+      chain = e_graph.node(NodeKind::G, {chain});
+    }
+    Node* late = e_graph.node(NodeKind::F, {z, z});
+    cone = e_graph.extract(late);
+    unittest_assert(cone.size() == 2);
+    unittest_assert(cone.at(z) == z);
+    unittest_assert(cone.at(late) == late);
+    unittest_assert(!cone.contains(chain));
+    bool thrown = false;
+    try {
+      cone.at(y->root());
+    } catch (const egraphs::Error& error) {
+      thrown = true;
+    }
+    unittest_assert(thrown);
+  });
+  
+  unittest::Test("Extract (DAG)").run([](){
+    EGraph e_graph;
+    
+    Node* x = e_graph.node(NodeKind::X);
+    Node* y = e_graph.node(NodeKind::Y);
+    Node* shared = e_graph.node(NodeKind::H, {x, y});
+    Node* f = e_graph.node(NodeKind::F, {shared, shared});
+    Node* g = e_graph.node(NodeKind::Z);
+    for (size_t it = 0; it < 4; it++) {
+      g = e_graph.node(NodeKind::G, {g});
+    }
+    e_graph.merge(f, g);
+    
+    auto unit_cost = [](const egraphs::SimpleNodeData<NodeKind>& data){
+      return EGraph::Cost(1);
+    };
+    
+    // Tree cost: F(H(X, Y), H(X, Y)) = 7, G(G(G(G(Z)))) = 5
+    EGraph::Extracted tree = e_graph.extract(f);
+    unittest_assert(tree.at(f->root()) == g);
+    unittest_assert(e_graph.dag_cost(f, tree, unit_cost) == 5);
+    
+    // DAG cost: F(H(X, Y), H(X, Y)) = 4
+    EGraph::Extracted dag = e_graph.extract_dag(f);
+    unittest_assert(dag.at(f->root()) == f);
+    unittest_assert(e_graph.dag_cost(f, dag, unit_cost) == 4);
+    
+    dag = e_graph.extract_dag(f, unit_cost, 1.0);
+    unittest_assert(dag.at(f->root()) == f);
+    
+    dag = e_graph.extract_dag(f, [](const egraphs::SimpleNodeData<NodeKind>& data){
+      return data.kind() == NodeKind::H ? 10 : 1;
+    }, 1.0);
+    unittest_assert(dag.at(f->root()) == g);
+    
+    // Cyclic classes: F(X, F(X, ...)) = X
+    Node* cycle = e_graph.node(NodeKind::F, {x, x});
+    e_graph.merge(cycle, x);
+    dag = e_graph.extract_dag(cycle, unit_cost, 1.0);
+    unittest_assert(dag.at(x->root()) == x);
+    unittest_assert(e_graph.dag_cost(x, dag, unit_cost) == 1);
+  });
+  
+  unittest::Test("Extract (DAG, Branch and Bound)").run([](){
+    EGraph e_graph;
+    
+    // Random e-graphs in which branch and bound must never be worse
+    // than the greedy extraction
+    std::vector<Node*> nodes;
+    Random random(1);
+    add_random_nodes(e_graph, nodes, random, 60, 3, 3);
+    
+    auto cost_fn = [](const egraphs::SimpleNodeData<NodeKind>& data){
+      return EGraph::Cost(size_t(data.kind()) + 1);
+    };
+    
+    for (Node* node : nodes) {
+      EGraph::Extracted greedy = e_graph.extract_dag(node, cost_fn);
+      EGraph::Extracted exact = e_graph.extract_dag(node, cost_fn, 1.0);
+      EGraph::Cost greedy_cost = e_graph.dag_cost(node, greedy, cost_fn);
+      EGraph::Cost exact_cost = e_graph.dag_cost(node, exact, cost_fn);
+      unittest_assert(exact_cost <= greedy_cost);
+      unittest_assert(!exact_cost.is_inf());
+      unittest_assert(greedy_cost <= e_graph.dag_cost(node, e_graph.extract(node, cost_fn), cost_fn));
+    }
+  });
+  
+  unittest::Test("Extract (DAG, Tree)").run([](){
+    auto cost_fn = [](const egraphs::SimpleNodeData<NodeKind>& data){
+      return EGraph::Cost(size_t(data.kind()) * 3 + 1);
+    };
+    
+    // The DAG cost of the extracted term must never be worse than the
+    // DAG cost of the term found by tree extraction
+    for (uint64_t seed = 320; seed < 340; seed++) {
+      Random random(seed);
+      for (size_t graph = 0; graph < 20; graph++) {
+        EGraph e_graph;
+        std::vector<Node*> nodes;
+        add_random_nodes(e_graph, nodes, random, 11, 3, 3);
+        
+        for (Node* node : nodes) {
+          EGraph::Extracted dag = e_graph.extract_dag(node, cost_fn);
+          EGraph::Extracted tree = e_graph.extract(node, cost_fn);
+          unittest_assert(e_graph.dag_cost(node, dag, cost_fn) <= e_graph.dag_cost(node, tree, cost_fn));
+        }
+      }
+    }
+  });
+  
+  unittest::Test("Extract (DAG, Brute Force)").run([](){
+    auto cost_fn = [](const egraphs::SimpleNodeData<NodeKind>& data){
+      return EGraph::Cost(size_t(data.kind()) * 3 + 1);
+    };
+    
+    // Exact extraction must find the optimal term of small random
+    // e-graphs, which is computed by trying all selections
+    Random random(5);
+    for (size_t graph = 0; graph < 40; graph++) {
+      EGraph e_graph;
+      std::vector<Node*> nodes;
+      add_random_nodes(e_graph, nodes, random, 10, 3, 3);
+      
+      Node* root = nodes.back()->root();
+      EGraph::Extracted selection = e_graph.extract(root);
+      std::vector<std::vector<Node*>> candidates;
+      size_t combinations = 1;
+      for (Node* class_root : selection.index().roots()) {
+        candidates.emplace_back();
+        for (Node* node : class_root->e_class()) {
+          candidates.back().push_back(node);
+        }
+        combinations *= candidates.back().size();
+      }
+      
+      EGraph::Cost best = EGraph::Cost::inf();
+      for (size_t combination = 0; combination < combinations; combination++) {
+        size_t rest = combination;
+        for (size_t it = 0; it < candidates.size(); it++) {
+          selection[it] = candidates[it][rest % candidates[it].size()];
+          rest /= candidates[it].size();
+        }
+        
+        std::map<Node*, int> state;
+        std::function<bool(Node*)> is_cyclic = [&](Node* class_root){
+          state[class_root] = 1;
+          for (Node* child : *selection.at(class_root)) {
+            if (state[child] == 1 || (state[child] == 0 && is_cyclic(child))) {
+              return true;
+            }
+          }
+          state[class_root] = 2;
+          return false;
+        };
+        if (!is_cyclic(root)) {
+          best = std::min(best, e_graph.dag_cost(root, selection, cost_fn));
+        }
+      }
+      
+      EGraph::Extracted greedy = e_graph.extract_dag(root, cost_fn);
+      EGraph::Extracted exact = e_graph.extract_dag(root, cost_fn, 10.0);
+      unittest_assert(e_graph.dag_cost(root, exact, cost_fn) == best);
+      unittest_assert(e_graph.dag_cost(root, greedy, cost_fn) >= best);
+    }
+  });
+  
+  unittest::Test("Extract (DAG, Large)").run([](){
+    EGraph e_graph;
+    
+    // The class sets of the greedy selection would grow quadratically,
+    // so the tree cost is minimized instead
+    Node* x = e_graph.node(NodeKind::X);
+    Node* chain = x;
+    for (size_t it = 0; it < 5000; it++) {
+      chain = e_graph.node(NodeKind::F, {chain, x});
+    }
+    Node* y = e_graph.node(NodeKind::Y);
+    e_graph.merge(chain, e_graph.node(NodeKind::G, {y}));
+    
+    EGraph::Extracted dag = e_graph.extract_dag(chain);
+    unittest_assert(dag.at(chain->root())->data().kind() == NodeKind::G);
+    unittest_assert(e_graph.dag_cost(chain, dag, EGraph::UnitCost()) == 2);
+  });
+  
+  unittest::Test("Extract (Incremental)").run([](){
+    EGraph e_graph;
+    
+    auto cost_fn = [](const egraphs::SimpleNodeData<NodeKind>& data){
+      return EGraph::Cost(size_t(data.kind()) + 1);
+    };
+    EGraph::Extractor extractor(cost_fn);
+    
+    std::vector<Node*> nodes;
+    Random random(3);
+    
+    for (size_t step = 0; step < 20; step++) {
+      add_random_nodes(e_graph, nodes, random, 10, 6, 2, 10);
+      
+      extractor.update(e_graph);
+      unittest_assert(extractor.epoch() == e_graph.epoch());
+      
+      EGraph::Extracted extracted = e_graph.extract(cost_fn);
+      EGraph::Extracted incremental = extractor.extracted(e_graph);
+      unittest_assert(incremental.size() == extracted.size());
+      
+      // Tree cost of the term extracted for each class
+      std::unordered_map<Node*, EGraph::Cost> costs;
+      std::function<EGraph::Cost(Node*)> tree_cost = [&](Node* root){
+        if (costs.find(root) == costs.end()) {
+          EGraph::Cost cost = cost_fn(extracted.at(root)->data());
+          for (Node* child : *extracted.at(root)) {
+            cost += tree_cost(child);
+          }
+          costs[root] = cost;
+        }
+        return costs.at(root);
+      };
+      
+      for (size_t it = 0; it < extracted.size(); it++) {
+        unittest_assert(incremental[it] == extracted[it]);
+      }
+      for (Node* node : nodes) {
+        unittest_assert(extractor.at(node)->find() == node->find());
+        unittest_assert(incremental.at(node->root()) == extractor.at(node));
+        unittest_assert(extractor.cost(node) == tree_cost(node->root()));
+      }
+    }
+  });
+  
+  unittest::Test("Extract (K-Best)").run([](){
+    EGraph e_graph;
+    
+    Node* x = e_graph.node(NodeKind::X);
+    Node* y = e_graph.node(NodeKind::Y);
+    e_graph.merge(x, y);
+    Node* f = e_graph.node(NodeKind::F, {x->root(), x->root()});
+    
+    auto cost_fn = [](const egraphs::SimpleNodeData<NodeKind>& data){
+      return EGraph::Cost(data.kind() == NodeKind::Y ? 2 : 1);
+    };
+    
+    auto term = [&](const EGraph::KBest& k_best, Node* root, size_t rank){
+      std::ostringstream stream;
+      k_best.write(stream, root, rank);
+      return stream.str();
+    };
+    
+    EGraph::KBest k_best = e_graph.extract_k_best(f, 10, cost_fn);
+    unittest_assert(k_best.count(f) == 4);
+    unittest_assert(term(k_best, f, 0) == "F(X, X)");
+    unittest_assert(k_best.cost(f, 0) == 3);
+    unittest_assert(k_best.cost(f, 1) == 4);
+    unittest_assert(k_best.cost(f, 2) == 4);
+    unittest_assert(term(k_best, f, 3) == "F(Y, Y)");
+    unittest_assert(k_best.cost(f, 3) == 5);
+    
+    std::set<std::string> terms;
+    for (size_t rank = 0; rank < k_best.count(f); rank++) {
+      terms.insert(term(k_best, f, rank));
+    }
+    unittest_assert(terms.size() == 4);
+    
+    // Cyclic classes have infinitely many terms
+    e_graph.merge(x, e_graph.node(NodeKind::G, {x->root()}));
+    x = x->root();
+    f = f->root();
+    k_best = e_graph.extract_k_best(x, 5, cost_fn);
+    unittest_assert(k_best.count(x) == 5);
+    unittest_assert(term(k_best, x, 0) == "X");
+    unittest_assert(term(k_best, x, 1) == "Y" || term(k_best, x, 1) == "G(X)");
+    unittest_assert(term(k_best, x, 2) == "Y" || term(k_best, x, 2) == "G(X)");
+    for (size_t rank = 1; rank < 5; rank++) {
+      unittest_assert(k_best.cost(x, rank - 1) <= k_best.cost(x, rank));
+    }
+    unittest_assert(k_best.cost(x, 4) == 3);
+    
+    k_best = e_graph.extract_k_best(f, 100);
+    unittest_assert(k_best.count(f) == 100);
+    unittest_assert(k_best.cost(f, 0) == 3);
+  });
+  
+  unittest::Test("Extract (K-Best, Brute Force)").run([](){
+    auto cost_fn = [](const egraphs::SimpleNodeData<NodeKind>& data){
+      return EGraph::Cost(size_t(data.kind()) + 1);
+    };
+    
+    // The costs of the k best terms of small random e-graphs must match
+    // the costs of all terms up to a bound, which are enumerated by
+    // combining the terms of the children of every node
+    Random random(7);
+    const uint64_t bound = 12;
+    for (size_t graph = 0; graph < 40; graph++) {
+      EGraph e_graph;
+      std::vector<Node*> nodes;
+      add_random_nodes(e_graph, nodes, random, 10, 3, 2);
+      
+      // Every term has a cost of at least 1, so terms with a cost of at
+      // most bound are found after bound iterations
+      std::map<Node*, std::multiset<uint64_t>> terms;
+      for (size_t iteration = 0; iteration < bound; iteration++) {
+        std::map<Node*, std::multiset<uint64_t>> next;
+        for (Node* root : e_graph.roots()) {
+          for (Node* node : root->e_class()) {
+            std::vector<uint64_t> costs = {cost_fn(node->data()).value()};
+            for (Node* child : *node) {
+              std::vector<uint64_t> combined;
+              for (uint64_t cost : costs) {
+                for (uint64_t child_cost : terms[child->root()]) {
+                  if (cost + child_cost <= bound) {
+                    combined.push_back(cost + child_cost);
+                  }
+                }
+              }
+              costs = combined;
+            }
+            next[root].insert(costs.begin(), costs.end());
+          }
+        }
+        terms = next;
+      }
+      
+      for (Node* node : nodes) {
+        Node* root = node->root();
+        std::vector<uint64_t> expected(terms[root].begin(), terms[root].end());
+        EGraph::KBest k_best = e_graph.extract_k_best(root, 4, cost_fn);
+        size_t count = 0;
+        while (count < k_best.count(root) && k_best.cost(root, count).value() <= bound) {
+          unittest_assert(count < expected.size());
+          unittest_assert(k_best.cost(root, count).value() == expected[count]);
+          count++;
+        }
+        unittest_assert(count == std::min(expected.size(), size_t(4)));
+      }
+    }
+  });
+  
+  unittest::Test("Extract (Parallel)").run([](){
+    EGraph e_graph;
+    
+    std::vector<Node*> nodes;
+    Random random(5);
+    add_random_nodes(e_graph, nodes, random, 2000, 3, 2, 100);
+    
+    // Unit costs cause many ties, which are broken by node id
+    egraphs::ThreadPool pool(4);
+    EGraph::Extracted sequential = e_graph.extract();
+    EGraph::Extracted parallel = e_graph.extract(pool);
+    unittest_assert(sequential.size() == parallel.size());
+    for (size_t it = 0; it < sequential.size(); it++) {
+      unittest_assert(sequential[it] == parallel[it]);
+    }
+    
+    auto cost_fn = [](Node* node, const EGraph::Costs& costs){
+      EGraph::Cost cost = size_t(node->data().kind()) + 1;
+      for (Node* child : *node) {
+        cost += costs.at(child);
+      }
+      return cost;
+    };
+    sequential = e_graph.extract(cost_fn);
+    parallel = e_graph.extract(pool, cost_fn);
+    for (size_t it = 0; it < sequential.size(); it++) {
+      unittest_assert(sequential[it] == parallel[it]);
+    }
+  });
+  
   return 0;
 }